@@ -0,0 +1,231 @@
+// bench.cpp
+// ---------
+// Benchmark of the pipeline's stages over a fixed set of grammars, without
+// any GL. Build it on its own:
+//   g++ -std=c++17 -O2 -pthread bench.cpp -o bench
+// and run 'bench [--reps n] [--res voxels]'. Prints one JSON object per
+// line and stage: the best time over the repetitions, and its rate.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "pipeline.hpp"
+
+// the input.json binary tree, derived deeper
+const char* binaryTree = R"({
+    "modules": [
+        {"symbol": "A", "parameters": []},
+        {"symbol": "F", "parameters": ["x"]},
+        {"symbol": "[", "parameters": []},
+        {"symbol": "]", "parameters": []},
+        {"symbol": "+", "parameters": ["x"]},
+        {"symbol": "-", "parameters": ["x"]}
+    ],
+    "axiom": [{"symbol": "A", "parameters": []}],
+    "rules": [
+        {"symbol": "A", "conditions": [], "word": [
+            {"symbol": "F", "parameters": ["1"]},
+            {"symbol": "[", "parameters": []},
+            {"symbol": "+", "parameters": ["1.48353"]},
+            {"symbol": "A", "parameters": []},
+            {"symbol": "]", "parameters": []},
+            {"symbol": "[", "parameters": []},
+            {"symbol": "-", "parameters": ["1.48353"]},
+            {"symbol": "A", "parameters": []},
+            {"symbol": "]", "parameters": []}
+        ]},
+        {"symbol": "F", "conditions": [], "word": [
+            {"symbol": "F", "parameters": ["1.456 x *"]}
+        ]}
+    ],
+    "iter": "16"
+})";
+
+// a stochastic bush: each apex branches three ways, two ways or bends on,
+// thinning as it goes
+const char* bush = R"({
+    "modules": [
+        {"symbol": "A", "parameters": ["w"]},
+        {"symbol": "F", "parameters": ["s"]},
+        {"symbol": "[", "parameters": []},
+        {"symbol": "]", "parameters": []},
+        {"symbol": "&", "parameters": ["x"]},
+        {"symbol": "*", "parameters": ["x"]},
+        {"symbol": "!", "parameters": ["w"]}
+    ],
+    "axiom": [
+        {"symbol": "F", "parameters": ["1"]},
+        {"symbol": "A", "parameters": ["0.2"]}
+    ],
+    "rules": [
+        {"symbol": "A", "conditions": [], "probability": "0.5", "word": [
+            {"symbol": "!", "parameters": ["w"]},
+            {"symbol": "[", "parameters": []},
+            {"symbol": "&", "parameters": ["0.4"]},
+            {"symbol": "F", "parameters": ["1"]},
+            {"symbol": "A", "parameters": ["w 0.7 *"]},
+            {"symbol": "]", "parameters": []},
+            {"symbol": "*", "parameters": ["2.1"]},
+            {"symbol": "[", "parameters": []},
+            {"symbol": "&", "parameters": ["0.4"]},
+            {"symbol": "F", "parameters": ["1"]},
+            {"symbol": "A", "parameters": ["w 0.7 *"]},
+            {"symbol": "]", "parameters": []},
+            {"symbol": "*", "parameters": ["2.1"]},
+            {"symbol": "[", "parameters": []},
+            {"symbol": "&", "parameters": ["0.4"]},
+            {"symbol": "F", "parameters": ["1"]},
+            {"symbol": "A", "parameters": ["w 0.7 *"]},
+            {"symbol": "]", "parameters": []}
+        ]},
+        {"symbol": "A", "conditions": [], "probability": "0.3", "word": [
+            {"symbol": "!", "parameters": ["w"]},
+            {"symbol": "[", "parameters": []},
+            {"symbol": "&", "parameters": ["0.5"]},
+            {"symbol": "F", "parameters": ["1"]},
+            {"symbol": "A", "parameters": ["w 0.7 *"]},
+            {"symbol": "]", "parameters": []},
+            {"symbol": "*", "parameters": ["3.1"]},
+            {"symbol": "[", "parameters": []},
+            {"symbol": "&", "parameters": ["0.5"]},
+            {"symbol": "F", "parameters": ["1"]},
+            {"symbol": "A", "parameters": ["w 0.7 *"]},
+            {"symbol": "]", "parameters": []}
+        ]},
+        {"symbol": "A", "conditions": [], "probability": "0.2", "word": [
+            {"symbol": "&", "parameters": ["0.2"]},
+            {"symbol": "F", "parameters": ["1"]},
+            {"symbol": "A", "parameters": ["w 0.9 *"]}
+        ]},
+        {"symbol": "F", "conditions": [], "word": [
+            {"symbol": "F", "parameters": ["s 1.1 *"]}
+        ]}
+    ],
+    "seed": "1",
+    "iter": "14"
+})";
+
+// a deep parametric tree: conditions, two-parameter apices and widths
+const char* deepTree = R"({
+    "modules": [
+        {"symbol": "A", "parameters": ["s", "w"]},
+        {"symbol": "F", "parameters": ["s"]},
+        {"symbol": "[", "parameters": []},
+        {"symbol": "]", "parameters": []},
+        {"symbol": "+", "parameters": ["x"]},
+        {"symbol": "-", "parameters": ["x"]},
+        {"symbol": "&", "parameters": ["x"]},
+        {"symbol": "^", "parameters": ["x"]},
+        {"symbol": "!", "parameters": ["w"]}
+    ],
+    "axiom": [{"symbol": "A", "parameters": ["10", "1"]}],
+    "rules": [
+        {"symbol": "A", "conditions": ["s 0.05 >="], "word": [
+            {"symbol": "!", "parameters": ["w"]},
+            {"symbol": "F", "parameters": ["s"]},
+            {"symbol": "[", "parameters": []},
+            {"symbol": "+", "parameters": ["0.5"]},
+            {"symbol": "&", "parameters": ["0.3"]},
+            {"symbol": "A", "parameters": ["s 0.8 *", "w 0.7 *"]},
+            {"symbol": "]", "parameters": []},
+            {"symbol": "[", "parameters": []},
+            {"symbol": "-", "parameters": ["0.6"]},
+            {"symbol": "^", "parameters": ["0.2"]},
+            {"symbol": "A", "parameters": ["s 0.75 *", "w 0.6 *"]},
+            {"symbol": "]", "parameters": []}
+        ]},
+        {"symbol": "A", "conditions": ["s 0.05 <"], "word": [
+            {"symbol": "F", "parameters": ["s"]}
+        ]},
+        {"symbol": "F", "conditions": ["s 1 >"], "word": [
+            {"symbol": "F", "parameters": ["s 1.02 *"]}
+        ]}
+    ],
+    "iter": "17"
+})";
+
+struct benchmark {
+    const char* name;
+    const char* spec;
+};
+
+// best wall time of 'reps' runs of 'stage', in seconds
+template<typename Stage>
+double best(int reps, Stage stage) {
+    double t = 0;
+    for(int r = 0; r < reps; ++r) {
+        auto t0 = std::chrono::steady_clock::now();
+        stage();
+        auto t1 = std::chrono::steady_clock::now();
+        double s = std::chrono::duration<double>(t1-t0).count();
+        if((r == 0) || (s < t)) t = s;
+    }
+    return t;
+}
+
+void report(const char* name, const char* stage, int iter, int reps,
+    double seconds, size_t items, const char* unit)
+{
+    std::printf("{\"benchmark\": \"%s\", \"stage\": \"%s\", \"iterations\": %d, "
+        "\"reps\": %d, \"seconds\": %.9g, \"items\": %zu, \"unit\": \"%s\", "
+        "\"rate\": %.9g}\n", name, stage, iter, reps, seconds, items, unit,
+        (seconds > 0) ? items/seconds : 0.0);
+    std::fflush(stdout);
+}
+
+int main(int argc, char* argv[]) {
+    int reps = 5, res = 64;
+    for(int a = 1; a+1 < argc; ++a) {
+        std::string arg = argv[a];
+        if(arg == "--reps") reps = std::max(1, std::stoi(argv[++a]));
+        else if(arg == "--res") res = std::max(1, std::stoi(argv[++a]));
+    }
+    const std::vector<benchmark> benchmarks = {
+        {"binary-tree", binaryTree},
+        {"bush", bush},
+        {"deep-parametric", deepTree}
+    };
+    parallel::pool threads;
+    for(const benchmark& b : benchmarks) {
+        pipeline::plant p;
+        double t = best(reps, [&]() { pipeline::loadString(b.spec, p); });
+        report(b.name, "load", p.iter, reps, t, p.rules.size(), "rules");
+
+        // derivation, serial & parallel: modules written over all steps
+        size_t written = 0;
+        for(parallel::pool* pool : {(parallel::pool*)nullptr, &threads}) {
+            t = best(reps, [&]() {
+                grammar::derivation derivation(p.axiom, pool);
+                written = 0;
+                for(int i = 1; i <= p.iter; ++i) {
+                    derivation.step(p.rules);
+                    written += derivation.current().size();
+                }
+            });
+            report(b.name, pool ? "derive-parallel" : "derive", p.iter, reps, t,
+                written, "modules");
+        }
+        grammar::derivation derivation(p.axiom, &threads);
+        for(int i = 1; i <= p.iter; ++i) derivation.step(p.rules);
+
+        turtle::segments segs;
+        t = best(reps, [&]() {
+            segs.clear();
+            turtle::interpret(derivation.current(), segs);
+        });
+        report(b.name, "interpret", p.iter, reps, t, segs.size(), "segments");
+
+        int d = std::max(pipeline::scale(segs), 1);
+        t = best(reps, [&]() { pipeline::voxelize(segs, d, res); });
+        report(b.name, "voxelize", p.iter, reps, t, sampler::img.size(), "voxels");
+
+        mesher::mesh surface;
+        t = best(reps, [&]() { surface = mesher::greedy(sampler::img, 0.5f); });
+        report(b.name, "mesh-greedy", p.iter, reps, t, surface.triangles(), "triangles");
+        t = best(reps, [&]() { surface = mesher::marchingCubes(sampler::img, 0.5f, &threads); });
+        report(b.name, "mesh-smooth", p.iter, reps, t, surface.triangles(), "triangles");
+    }
+}
@@ -0,0 +1,283 @@
+// binary.hpp
+// ----------
+// Compact binary files for derived words and segment lists, laid out to be
+// mmap'd and read in place.
+//
+// A file is a 32 byte header, a table of sections and the sections, each
+// 8 byte aligned. Everything is little-endian.
+//   header:  magic "TORTUGA\0", uint32 version, uint32 kind,
+//            uint64 count, uint32 sections, uint32 reserved
+//   table:   per section, uint64 offset (from the file start) & uint64 bytes
+// A word ('count' modules) has sections: symbols (one char per module id),
+// ids (uint16), offsets (uint32, count+1 of them) and the pool (double).
+// A segment list ('count' segments) has sections: start & end (float xyz
+// triples), radius and depth (float).
+
+#ifndef BINARY_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "grammar.hpp"
+#include "turtle.hpp"
+
+namespace binary {
+    const char magic[8] = {'T','O','R','T','U','G','A','\0'};
+    const uint32_t version = 1;
+    enum kind : uint32_t { wordKind = 1, segmentKind = 2 };
+
+    struct header {
+        char magic[8];
+        uint32_t version;
+        uint32_t kind;
+        uint64_t count;
+        uint32_t sections;
+        uint32_t reserved;
+    };
+    struct section {
+        uint64_t offset;
+        uint64_t bytes;
+    };
+    static_assert(sizeof(header) == 32, "header must be 32 bytes");
+    static_assert(sizeof(section) == 16, "section must be 16 bytes");
+
+    bool littleEndian() {
+        const uint16_t one = 1;
+        return *(const unsigned char*)&one == 1;
+    }
+    size_t align8(size_t n) { return (n + 7) & ~size_t(7); }
+
+    // writer: gathers sections, then lays them out behind the header
+    class writer {
+        struct part {
+            const void* data;
+            size_t size, bytes;     // element size, total bytes
+        };
+        std::vector<part> parts;
+        // store 'n' bytes of elements of 'size', swapped on big-endian hosts
+        static bool store(FILE* out, const void* data, size_t size, size_t n) {
+            if(littleEndian() || (size == 1))
+                return std::fwrite(data, 1, n, out) == n;
+            std::vector<unsigned char> swapped((const unsigned char*)data,
+                (const unsigned char*)data + n);
+            for(size_t e = 0; e < n; e += size)
+                std::reverse(swapped.begin()+e, swapped.begin()+e+size);
+            return std::fwrite(swapped.data(), 1, n, out) == n;
+        }
+    public:
+        template<typename T>
+        void add(const T* data, size_t count) {
+            parts.push_back({data, sizeof(T), count*sizeof(T)});
+        }
+        // write to 'filename'; false if it cannot be written
+        bool write(const std::string& filename, kind k, uint64_t count) const {
+            FILE* out = std::fopen(filename.c_str(), "wb");
+            if(out == nullptr) return false;
+            header h;
+            std::memcpy(h.magic, magic, sizeof(magic));
+            h.version = version;
+            h.kind = k;
+            h.count = count;
+            h.sections = parts.size();
+            h.reserved = 0;
+            std::vector<section> table;
+            size_t at = align8(sizeof(header) + parts.size()*sizeof(section));
+            for(const part& p : parts) {
+                table.push_back({at, p.bytes});
+                at = align8(at + p.bytes);
+            }
+            bool ok = store(out, h.magic, 1, sizeof(h.magic))
+                && store(out, &h.version, 4, 4) && store(out, &h.kind, 4, 4)
+                && store(out, &h.count, 8, 8) && store(out, &h.sections, 4, 4)
+                && store(out, &h.reserved, 4, 4)
+                && store(out, table.data(), 8, table.size()*sizeof(section));
+            const char zeros[8] = {0};
+            size_t written = sizeof(header) + table.size()*sizeof(section);
+            for(size_t s = 0; ok && (s < parts.size()); ++s) {
+                ok = store(out, zeros, 1, table[s].offset - written)
+                    && store(out, parts[s].data, parts[s].size, parts[s].bytes);
+                written = table[s].offset + parts[s].bytes;
+            }
+            return (std::fclose(out) == 0) && ok;
+        }
+    };
+
+    // write the packed word 'w', with the letters of the module table
+    bool write(const grammar::packedWord& w, const std::string& filename) {
+        std::vector<char> symbols;
+        for(const auto& m : grammar::modules) symbols.push_back(m->getLetter());
+        writer out;
+        out.add(symbols.data(), symbols.size());
+        out.add(w.ids.data(), w.ids.size());
+        out.add(w.offsets.data(), w.offsets.size());
+        out.add(w.pool.data(), w.pool.size());
+        return out.write(filename, wordKind, w.size());
+    }
+    // write the segment list 'segs'
+    bool write(const turtle::segments& segs, const std::string& filename) {
+        writer out;
+        out.add(segs.start.data(), segs.start.size());
+        out.add(segs.end.data(), segs.end.size());
+        out.add(segs.radius.data(), segs.radius.size());
+        out.add(segs.depth.data(), segs.depth.size());
+        return out.write(filename, segmentKind, segs.size());
+    }
+
+    // read-only mapping of a binary file, checked on open: views point
+    // straight into the mapping and live as long as it does
+    class mapping {
+        int fd = -1;
+        const unsigned char* base = nullptr;
+        size_t mapped = 0;
+        const header* h = nullptr;
+        const section* table = nullptr;
+
+        bool fail(const std::string& filename, const char* why) {
+            std::cout << "(binary) " << filename << ": " << why << "\n";
+            close();
+            return false;
+        }
+    public:
+        mapping() {}
+        mapping(const mapping&) = delete;
+        mapping& operator=(const mapping&) = delete;
+        ~mapping() { close(); }
+
+        // map 'filename', expecting 'k' with 'sections' sections
+        bool open(const std::string& filename, kind k, uint32_t sections) {
+            close();
+            if(!littleEndian()) return fail(filename, "mapping needs a little-endian host");
+            fd = ::open(filename.c_str(), O_RDONLY);
+            if(fd < 0) return fail(filename, "could not open");
+            struct stat st;
+            if((fstat(fd, &st) != 0) || ((size_t)st.st_size < sizeof(header)))
+                return fail(filename, "too short");
+            mapped = st.st_size;
+            void* m = mmap(nullptr, mapped, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(m == MAP_FAILED) {
+                base = nullptr;
+                return fail(filename, "could not map");
+            }
+            base = (const unsigned char*)m;
+            h = (const header*)base;
+            if(std::memcmp(h->magic, magic, sizeof(magic)) != 0)
+                return fail(filename, "not a tortuga file");
+            if(h->version != version) return fail(filename, "unsupported version");
+            if((h->kind != k) || (h->sections != sections))
+                return fail(filename, "unexpected contents");
+            if(sizeof(header) + sections*sizeof(section) > mapped)
+                return fail(filename, "truncated");
+            table = (const section*)(base + sizeof(header));
+            for(uint32_t s = 0; s < sections; ++s) {
+                if((table[s].offset % 8 != 0) || (table[s].offset > mapped)
+                    || (table[s].bytes > mapped - table[s].offset))
+                    return fail(filename, "bad section");
+            }
+            return true;
+        }
+        void close() {
+            if(base != nullptr) munmap((void*)base, mapped);
+            if(fd >= 0) ::close(fd);
+            fd = -1; base = nullptr; mapped = 0; h = nullptr; table = nullptr;
+        }
+        uint64_t count() const { return h->count; }
+        // section 's' as an array of T, and its length
+        template<typename T>
+        const T* get(uint32_t s) const { return (const T*)(base + table[s].offset); }
+        template<typename T>
+        size_t length(uint32_t s) const { return table[s].bytes / sizeof(T); }
+    };
+
+    // zero-copy view of a mapped word
+    class wordView {
+        mapping map;
+    public:
+        const char* symbols = nullptr;
+        const uint16_t* ids = nullptr;
+        const uint32_t* offsets = nullptr;
+        const double* pool = nullptr;
+        size_t symbolCount = 0, n = 0;
+
+        bool open(const std::string& filename) {
+            if(!map.open(filename, wordKind, 4)) return false;
+            n = map.count();
+            symbolCount = map.length<char>(0);
+            size_t vals = map.length<double>(3);
+            bool ok = (map.length<uint16_t>(1) == n) && (map.length<uint32_t>(2) == n+1);
+            ids = map.get<uint16_t>(1);
+            offsets = map.get<uint32_t>(2);
+            for(size_t i = 0; ok && (i < n); ++i)
+                ok = (ids[i] < symbolCount) && (offsets[i] <= offsets[i+1]);
+            if(!ok || (offsets[0] != 0) || (offsets[n] != vals)) {
+                std::cout << "(binary) " << filename << ": inconsistent word\n";
+                map.close();
+                return false;
+            }
+            symbols = map.get<char>(0);
+            pool = map.get<double>(3);
+            return true;
+        }
+        size_t size() const { return n; }
+        char getLetter(size_t i) const { return symbols[ids[i]]; }
+        const double* getVals(size_t i) const { return pool + offsets[i]; }
+        size_t getValCount(size_t i) const { return offsets[i+1] - offsets[i]; }
+        // true if the module ids mean the same letters as in grammar::modules
+        bool matchesModules() const {
+            if(symbolCount != grammar::modules.size()) return false;
+            for(size_t m = 0; m < symbolCount; ++m)
+                if(symbols[m] != grammar::modules[m]->getLetter()) return false;
+            return true;
+        }
+        // copy into a packed word, to derive further
+        grammar::packedWord copy() const {
+            grammar::packedWord w;
+            w.ids.assign(ids, ids+n);
+            w.offsets.assign(offsets, offsets+n+1);
+            w.pool.assign(pool, pool+offsets[n]);
+            return w;
+        }
+    };
+
+    // zero-copy view of a mapped segment list
+    class segmentView {
+        mapping map;
+    public:
+        const float* start = nullptr;
+        const float* end = nullptr;
+        const float* radius = nullptr;
+        const float* depth = nullptr;
+        size_t n = 0;
+
+        bool open(const std::string& filename) {
+            if(!map.open(filename, segmentKind, 4)) return false;
+            n = map.count();
+            if((map.length<float>(0) != 3*n) || (map.length<float>(1) != 3*n)
+                || (map.length<float>(2) != n) || (map.length<float>(3) != n)) {
+                std::cout << "(binary) " << filename << ": inconsistent segments\n";
+                map.close();
+                return false;
+            }
+            start = map.get<float>(0);
+            end = map.get<float>(1);
+            radius = map.get<float>(2);
+            depth = map.get<float>(3);
+            return true;
+        }
+        size_t size() const { return n; }
+        vec3 getStart(size_t i) const { return vec3(start[3*i],start[3*i+1],start[3*i+2]); }
+        vec3 getEnd(size_t i) const { return vec3(end[3*i],end[3*i+1],end[3*i+2]); }
+    };
+}
+
+#define BINARY_HPP
+#endif
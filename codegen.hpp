@@ -0,0 +1,278 @@
+// codegen.hpp
+// -----------
+// Offline compilation of a grammar to C++: emits a translation unit whose
+// kernel::apply does what grammar::apply does for that one grammar, with
+// every letter's rules as a switch case and every condition & expression
+// as inlined arithmetic, so no expression is interpreted at derivation
+// time. Context-sensitive grammars aren't compiled.
+
+#ifndef CODEGEN_HPP
+
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "grammar.hpp"
+#include "parse.hpp"
+
+namespace codegen {
+    // a double literal that reads back to exactly 'v'
+    std::string literal(double v) {
+        if(std::isnan(v)) return "NAN";
+        if(std::isinf(v)) return (v < 0) ? "(-HUGE_VAL)" : "HUGE_VAL";
+        char buf[32];
+        std::snprintf(buf, sizeof(buf), "%.17g", v);
+        std::string s = buf;
+        if(s.find_first_of(".e") == std::string::npos) s += ".0";
+        return (v < 0) ? "(" + s + ")" : s;
+    }
+    // infix C++ of a compiled expression, reading values from 'vals';
+    // operands keep the interpreter's order, so results match it exactly
+    std::string source(const parse::expression& e, const std::string& vals = "v") {
+        std::vector<std::string> stack;
+        for(const auto& in : e.getCode()) {
+            if(in.code == parse::op::param) {
+                stack.push_back(vals + "[" + std::to_string(in.arg) + "]");
+                continue;
+            }
+            if(in.code == parse::op::constant) {
+                stack.push_back(literal(e.getConstants()[in.arg]));
+                continue;
+            }
+            std::string b = stack.back(); stack.pop_back();
+            std::string a = stack.back(); stack.pop_back();
+            switch(in.code) {
+            case parse::op::add: stack.push_back("(" + b + " + " + a + ")"); break;
+            case parse::op::sub: stack.push_back("(" + a + " - " + b + ")"); break;
+            case parse::op::mul: stack.push_back("(" + b + " * " + a + ")"); break;
+            case parse::op::div: stack.push_back("(" + a + " / " + b + ")"); break;
+            case parse::op::lt: stack.push_back("double(" + a + " < " + b + ")"); break;
+            case parse::op::le: stack.push_back("double(" + a + " <= " + b + ")"); break;
+            case parse::op::gt: stack.push_back("double(" + a + " > " + b + ")"); break;
+            case parse::op::ge: stack.push_back("double(" + a + " >= " + b + ")"); break;
+            default: break;
+            }
+        }
+        return stack.empty() ? "0.0" : stack.back();
+    }
+    // a rule's conditions as one C++ boolean
+    std::string condition(const grammar::production& p) {
+        std::string s;
+        for(const auto& t : p.getTests()) {
+            if(!t.isValid()) return "false";
+            s += (s.empty() ? "" : " && ") + ("(" + source(t) + " != 0.0)");
+        }
+        return s.empty() ? "true" : s;
+    }
+    // text safe to put in a // comment: one line, not continued
+    std::string comment(std::string s) {
+        for(char& c : s)
+            if((c == '\n') || (c == '\r')) c = ' ';
+        if(!s.empty() && (s.back() == '\\')) s += '.';
+        return s;
+    }
+    // a rule in the input's terms, e.g. "F(x) : x 1 > -> F(1.02 x *)"
+    std::string describe(const grammar::production& p) {
+        std::string s(1, p.getLetter());
+        for(const auto& c : p.getConditions()) s += " : " + c;
+        s += " ->";
+        for(const auto& bp : p.getBlueprints()) {
+            s += " ";
+            s += bp.getLetter();
+            if(!bp.getEvals().empty()) {
+                s += "(";
+                for(size_t e = 0; e < bp.getEvals().size(); ++e)
+                    s += (e ? ", " : "") + bp.getEvals()[e];
+                s += ")";
+            }
+        }
+        return comment(s);
+    }
+
+    // emit the kernel of 'rules', as loaded from 'input' with module table
+    // grammar::modules, to 'out'; false if it can't be compiled
+    bool emit(const grammar::rewrites& rules, const std::string& input, std::ostream& out) {
+        if(rules.hasContext()) {
+            std::cout << "(codegen) context-sensitive rules can't be compiled\n";
+            return false;
+        }
+        std::string letters;
+        for(const auto& m : grammar::modules) letters += m->getLetter();
+
+        out << "// generated by tortuga --codegen from " << comment(input) << "\n"
+            << "// The derivation kernel of one grammar: kernel::apply rewrites a\n"
+            << "// packed word as grammar::apply would with these rules. Module ids\n"
+            << "// are the input's, so load it (or check compatible()) first. Build\n"
+            << "// with -ffp-contract=off to keep results bit-identical.\n\n"
+            << "#include <cmath>\n#include <cstdint>\n#include <cstring>\n#include <vector>\n\n"
+            << "#include \"grammar.hpp\"\n\n"
+            << "namespace kernel {\n"
+            << "    // module letters, by id, the kernel was compiled against\n"
+            << "    const char letters[] = \"";
+        for(char c : letters) {
+            if((c == '"') || (c == '\\')) out << '\\';
+            out << c;
+        }
+        out << "\";\n"
+            << "    const uint64_t seed = " << rules.getSeed() << "ull;\n\n"
+            << "    bool compatible() {\n"
+            << "        if(grammar::modules.size() != sizeof(letters)-1) return false;\n"
+            << "        for(size_t id = 0; id < grammar::modules.size(); ++id)\n"
+            << "            if(grammar::modules[id]->getLetter() != letters[id]) return false;\n"
+            << "        return true;\n"
+            << "    }\n\n";
+        if(rules.isStochastic()) {
+            out << "    // weighted pick among the rules that hold, as grammar::choose\n"
+                << "    int pick(const int* rules, const double* weights, const bool* held, int n,\n"
+                << "        uint32_t iteration, uint64_t position)\n"
+                << "    {\n"
+                << "        double total = 0;\n"
+                << "        for(int c = 0; c < n; ++c)\n"
+                << "            if(held[c]) total += weights[c];\n"
+                << "        if(total <= 0) return -1;\n"
+                << "        double u = philox::uniform(seed, iteration, position) * total;\n"
+                << "        int last = -1;\n"
+                << "        for(int c = 0; c < n; ++c) {\n"
+                << "            if(!held[c] || (weights[c] <= 0)) continue;\n"
+                << "            u -= weights[c];\n"
+                << "            last = rules[c];\n"
+                << "            if(u < 0) break;\n"
+                << "        }\n"
+                << "        return last;\n"
+                << "    }\n\n";
+        }
+
+        // matching: a case per letter with rules
+        out << "    // rule rewriting module 'id' with values 'v', or -1\n"
+            << "    int match(uint16_t id, const double* v, uint32_t iteration, uint64_t position) {\n"
+            << "        (void)v; (void)iteration; (void)position;\n"
+            << "        switch(id) {\n";
+        for(size_t id = 0; id < grammar::modules.size(); ++id) {
+            const std::vector<int>& candidates = rules.candidates(id);
+            if(candidates.empty()) continue;
+            out << "        case " << id << ": { // " << comment(std::string(1, letters[id])) << "\n";
+            if(rules.isStochastic(id)) {
+                size_t n = candidates.size();
+                std::string ids, weights, held;
+                for(size_t c = 0; c < n; ++c) {
+                    const grammar::production& p = rules[candidates[c]];
+                    ids += (c ? ", " : "") + std::to_string(candidates[c]);
+                    weights += (c ? ", " : "") + literal(p.getWeight());
+                    held += (c ? ",\n                " : "\n                ") + condition(p);
+                }
+                out << "            const int rules[] = {" << ids << "};\n"
+                    << "            const double weights[] = {" << weights << "};\n"
+                    << "            const bool held[] = {" << held << "};\n"
+                    << "            return pick(rules, weights, held, " << n
+                    << ", iteration, position);\n";
+            }
+            else {
+                bool always = false;
+                for(int r : candidates) {
+                    std::string test = condition(rules[r]);
+                    out << "            // " << describe(rules[r]) << "\n";
+                    if(test == "true") {
+                        out << "            return " << r << ";\n";
+                        always = true;
+                        break;
+                    }
+                    if(test != "false")
+                        out << "            if(" << test << ") return " << r << ";\n";
+                }
+                if(!always) out << "            return -1;\n";
+            }
+            out << "        }\n";
+        }
+        out << "        default: return -1;\n"
+            << "        }\n"
+            << "    }\n\n";
+
+        // rewriting: a case per rule, writing into a presized word
+        out << "    // modules & values written by each rule\n"
+            << "    const size_t sizes[][2] = {";
+        for(size_t r = 0; r < rules.size(); ++r)
+            out << (r ? ", " : "") << "{" << rules[r].getBlueprints().size() << ", "
+                << rules[r].getValCount() << "}";
+        if(rules.size() == 0) out << "{0, 0}";
+        out << "};\n"
+            << "    // write rule r's rewrite of values 'v' into 'w' at 'at'\n"
+            << "    void rewrite(int r, const double* v, grammar::packedWord& w, grammar::extent& at) {\n"
+            << "        (void)v;\n"
+            << "        switch(r) {\n";
+        for(size_t r = 0; r < rules.size(); ++r) {
+            out << "        case " << r << ": // " << describe(rules[r]) << "\n";
+            for(const auto& bp : rules[r].getBlueprints()) {
+                out << "            w.ids[at.modules++] = " << bp.getId() << ";\n";
+                for(const auto& e : bp.getExpressions())
+                    out << "            w.pool[at.vals++] = " << source(e) << ";\n";
+                out << "            w.offsets[at.modules] = at.vals;\n";
+            }
+            out << "            break;\n";
+        }
+        out << "        default: break;\n"
+            << "        }\n"
+            << "    }\n\n";
+
+        // the two passes of grammar::apply, and a derivation
+        out << "    // rewrite 'axiom' into 'out'; 'iteration' numbers the step\n"
+            << "    void apply(const grammar::packedWord& axiom, grammar::packedWord& out,\n"
+            << "        std::vector<int>& matches, uint32_t iteration = 0)\n"
+            << "    {\n"
+            << "        matches.resize(axiom.size());\n"
+            << "        grammar::extent size;\n"
+            << "        for(size_t i = 0; i < axiom.size(); ++i) {\n"
+            << "            int r = match(axiom.ids[i], axiom.getVals(i), iteration, i);\n"
+            << "            matches[i] = r;\n"
+            << "            size.modules += (r < 0) ? 1 : sizes[r][0];\n"
+            << "            size.vals += (r < 0) ? axiom.getValCount(i) : sizes[r][1];\n"
+            << "        }\n"
+            << "        out.resize(size);\n"
+            << "        grammar::extent at;\n"
+            << "        for(size_t i = 0; i < axiom.size(); ) {\n"
+            << "            if(matches[i] >= 0) {\n"
+            << "                rewrite(matches[i], axiom.getVals(i), out, at);\n"
+            << "                ++i; continue;\n"
+            << "            }\n"
+            << "            size_t j = i;\n"
+            << "            while((j < axiom.size())&&(matches[j] < 0)) ++j;\n"
+            << "            out.copy(axiom, i, j, at);\n"
+            << "            i = j;\n"
+            << "        }\n"
+            << "    }\n"
+            << "    // derive 'axiom' for 'iter' steps\n"
+            << "    grammar::packedWord derive(const grammar::word& axiom, int iter) {\n"
+            << "        grammar::packedWord front = grammar::pack(axiom), back;\n"
+            << "        std::vector<int> matches;\n"
+            << "        for(int i = 1; i <= iter; ++i) {\n"
+            << "            apply(front, back, matches, i);\n"
+            << "            front.swap(back);\n"
+            << "        }\n"
+            << "        return front;\n"
+            << "    }\n"
+            << "}\n";
+        return true;
+    }
+    // emit to 'filename'; false if it can't be compiled or written
+    bool write(const grammar::rewrites& rules, const std::string& input,
+        const std::string& filename)
+    {
+        std::ofstream out(filename);
+        if(!out) {
+            std::cout << "(codegen) could not open " << filename << "\n";
+            return false;
+        }
+        if(!emit(rules, input, out)) return false;
+        out.close();
+        if(!out) {
+            std::cout << "(codegen) could not write " << filename << "\n";
+            return false;
+        }
+        return true;
+    }
+}
+
+#define CODEGEN_HPP
+#endif
@@ -0,0 +1,102 @@
+// dump.hpp
+// --------
+// Streaming text dump of derived words, written through a fixed buffer
+// straight to a file descriptor - no string of the whole word is built.
+// Output matches grammar::wordToString: values print like std::ostream's
+// default, i.e. %g with 6 significant digits.
+
+#ifndef DUMP_HPP
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "grammar.hpp"
+
+namespace dump {
+    class writer {
+        int fd;
+        std::vector<char> buffer;
+        size_t used = 0;
+        bool failed = false;
+    public:
+        // longest value: sign, 6 digits, point, exponent
+        static constexpr size_t maxValue = 32;
+
+        writer(int fd, size_t capacity = 1 << 16)
+            : fd(fd), buffer(std::max(capacity, 2*maxValue))
+            {}
+        writer(const writer&) = delete;
+        writer& operator=(const writer&) = delete;
+        ~writer() { flush(); }
+
+        // false once a write has failed
+        bool good() const { return !failed; }
+        void flush() {
+            size_t done = 0;
+            while(!failed && (done < used)) {
+                ssize_t n = ::write(fd, buffer.data() + done, used - done);
+                if(n < 0) {
+                    if(errno == EINTR) continue;
+                    failed = true;
+                }
+                else done += n;
+            }
+            used = 0;
+        }
+        void put(char c) {
+            if(used == buffer.size()) flush();
+            buffer[used++] = c;
+        }
+        void put(const char* s, size_t n) {
+            while(n > 0) {
+                if(used == buffer.size()) flush();
+                size_t chunk = std::min(n, buffer.size() - used);
+                std::memcpy(buffer.data() + used, s, chunk);
+                used += chunk; s += chunk; n -= chunk;
+            }
+        }
+        void put(const std::string& s) { put(s.data(), s.size()); }
+        void put(double v) {
+            if(buffer.size() - used < maxValue) flush();
+            char* first = buffer.data() + used;
+            auto result = std::to_chars(first, first + maxValue, v,
+                std::chars_format::general, 6);
+            used += result.ptr - first;
+        }
+        void put(size_t v) {
+            if(buffer.size() - used < maxValue) flush();
+            char* first = buffer.data() + used;
+            used += std::to_chars(first, first + maxValue, v).ptr - first;
+        }
+    };
+
+    // one module: letter, then its values in parentheses
+    void module(writer& out, char letter, const double* vals, size_t count) {
+        out.put(letter);
+        if(count > 0) {
+            out.put('(');
+            for(size_t ii = 0; ii < count; ++ii) {
+                if(ii > 0) out.put(',');
+                out.put(vals[ii]);
+            }
+            out.put(')');
+        }
+    }
+    void word(writer& out, const grammar::packedWord& w) {
+        for(size_t i = 0; i < w.size(); ++i)
+            module(out, w.getLetter(i), w.getVals(i), w.getValCount(i));
+    }
+    void word(writer& out, const grammar::word& w) {
+        for(const auto& e : w)
+            module(out, e.getLetter(), e.getVals().data(), e.getVals().size());
+    }
+}
+
+#define DUMP_HPP
+#endif
@@ -0,0 +1,370 @@
+// gpu.hpp
+// -------
+// GPU buffers for tortuga's geometry (segments, voxels & meshes), drawn
+// instanced where the context supports it
+
+#ifndef GPU_HPP
+
+#include "include/glad/glad.h"
+#include "include/GLFW/glfw3.h"
+
+#include <cmath>
+#include <string>
+#include <vector>
+
+#include "turtle.hpp"
+#include "sampler.hpp"
+#include "mesher.hpp"
+
+namespace gpu {
+    // instanced drawing: core in ES 3.0, else an instanced_arrays extension
+    typedef void (APIENTRYP drawElementsInstancedFn)(GLenum mode, GLsizei count,
+        GLenum type, const void* indices, GLsizei instances);
+    typedef void (APIENTRYP vertexAttribDivisorFn)(GLuint index, GLuint divisor);
+    drawElementsInstancedFn drawElementsInstanced = nullptr;
+    vertexAttribDivisorFn vertexAttribDivisor = nullptr;
+
+    // load the instancing entry points of the current context; false if
+    // it has none, in which case callers fall back to plain draws
+    bool loadInstancing() {
+        std::string suffix;
+        if(GLVersion.major >= 3) suffix = "";
+        else if(glfwExtensionSupported("GL_EXT_instanced_arrays")) suffix = "EXT";
+        else if(glfwExtensionSupported("GL_ANGLE_instanced_arrays")) suffix = "ANGLE";
+        else if(glfwExtensionSupported("GL_NV_instanced_arrays")
+            &&glfwExtensionSupported("GL_NV_draw_instanced")) suffix = "NV";
+        else return false;
+        drawElementsInstanced = (drawElementsInstancedFn)
+            glfwGetProcAddress(("glDrawElementsInstanced" + suffix).c_str());
+        vertexAttribDivisor = (vertexAttribDivisorFn)
+            glfwGetProcAddress(("glVertexAttribDivisor" + suffix).c_str());
+        if(!drawElementsInstanced || !vertexAttribDivisor) {
+            drawElementsInstanced = nullptr;
+            vertexAttribDivisor = nullptr;
+            return false;
+        }
+        return true;
+    }
+
+    // upload 'bytes' of 'data' into a new static buffer bound to 'target'
+    GLuint buffer(GLenum target, const void* data, size_t bytes) {
+        GLuint b;
+        glGenBuffers(1, &b);
+        glBindBuffer(target, b);
+        glBufferData(target, bytes, data, GL_STATIC_DRAW);
+        return b;
+    }
+
+    // point attribute 'name' of 'program' at the bound array buffer
+    void attribute(GLuint program, const char* name, GLint size,
+        GLsizei stride, size_t offset, GLuint divisor)
+    {
+        GLint loc = glGetAttribLocation(program, name);
+        if(loc < 0) return;
+        glVertexAttribPointer(loc, size, GL_FLOAT, GL_FALSE, stride, (void*)offset);
+        glEnableVertexAttribArray(loc);
+        if(vertexAttribDivisor) vertexAttribDivisor(loc, divisor);
+    }
+    void release(GLuint program, const char* name) {
+        GLint loc = glGetAttribLocation(program, name);
+        if(loc < 0) return;
+        if(vertexAttribDivisor) vertexAttribDivisor(loc, 0);
+        glDisableVertexAttribArray(loc);
+    }
+
+    // turtle segments, drawn with shaders/segment_*.glsl: one instanced draw
+    // of a unit cylinder per segment, or a single GL_LINES draw without
+    // instancing. The segment buffer's arrays upload as they are.
+    class segmentMesh {
+        static const int sides = 8;
+        GLuint cylinder = 0, cylinderIndices = 0;
+        GLuint starts = 0, ends = 0, radii = 0, depths = 0;
+        GLuint lines = 0;
+        GLsizei indexCount = 0, instances = 0;
+        bool instanced = false;
+    public:
+        void upload(const turtle::segments& segs) {
+            release();
+            instances = segs.size();
+            instanced = (drawElementsInstanced != nullptr);
+            if(instanced) {
+                // unit cylinder - rings at z = 0 and z = 1
+                std::vector<float> verts;
+                for(int r = 0; r < 2; ++r) {
+                    for(int s = 0; s < sides; ++s) {
+                        float a = 2.0f*turtle::pi*s/sides;
+                        verts.insert(verts.end(), {cosf(a), sinf(a), (float)r});
+                    }
+                }
+                std::vector<unsigned short> idx;
+                for(int s = 0; s < sides; ++s) {
+                    unsigned short a = s, b = (s+1)%sides;
+                    idx.insert(idx.end(), {a, b, (unsigned short)(sides+b),
+                        (unsigned short)(sides+b), (unsigned short)(sides+a), a});
+                }
+                indexCount = idx.size();
+                cylinder = buffer(GL_ARRAY_BUFFER, verts.data(), verts.size()*sizeof(float));
+                cylinderIndices = buffer(GL_ELEMENT_ARRAY_BUFFER, idx.data(),
+                    idx.size()*sizeof(unsigned short));
+                // per-instance attributes
+                starts = buffer(GL_ARRAY_BUFFER, segs.start.data(), segs.start.size()*sizeof(float));
+                ends = buffer(GL_ARRAY_BUFFER, segs.end.data(), segs.end.size()*sizeof(float));
+                radii = buffer(GL_ARRAY_BUFFER, segs.radius.data(), segs.radius.size()*sizeof(float));
+                depths = buffer(GL_ARRAY_BUFFER, segs.depth.data(), segs.depth.size()*sizeof(float));
+            }
+            else {
+                // two vertices per segment, interleaved as the shader's
+                // attributes: (vPosition, iStart, iEnd, iRadius, iDepth)
+                std::vector<float> verts;
+                verts.reserve(22*segs.size());
+                for(size_t i = 0; i < segs.size(); ++i) {
+                    for(int z = 0; z < 2; ++z) {
+                        verts.insert(verts.end(), {0.0f, 0.0f, (float)z});
+                        verts.insert(verts.end(), segs.start.begin()+3*i, segs.start.begin()+3*i+3);
+                        verts.insert(verts.end(), segs.end.begin()+3*i, segs.end.begin()+3*i+3);
+                        verts.insert(verts.end(), {0.0f, segs.depth[i]});
+                    }
+                }
+                lines = buffer(GL_ARRAY_BUFFER, verts.data(), verts.size()*sizeof(float));
+            }
+        }
+        void draw(GLuint program) const {
+            if(instances == 0) return;
+            if(instanced) {
+                glBindBuffer(GL_ARRAY_BUFFER, cylinder);
+                attribute(program, "vPosition", 3, 0, 0, 0);
+                glBindBuffer(GL_ARRAY_BUFFER, starts);
+                attribute(program, "iStart", 3, 0, 0, 1);
+                glBindBuffer(GL_ARRAY_BUFFER, ends);
+                attribute(program, "iEnd", 3, 0, 0, 1);
+                glBindBuffer(GL_ARRAY_BUFFER, radii);
+                attribute(program, "iRadius", 1, 0, 0, 1);
+                glBindBuffer(GL_ARRAY_BUFFER, depths);
+                attribute(program, "iDepth", 1, 0, 0, 1);
+                glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, cylinderIndices);
+                drawElementsInstanced(GL_TRIANGLES, indexCount, GL_UNSIGNED_SHORT,
+                    nullptr, instances);
+            }
+            else {
+                GLsizei stride = 11*sizeof(float);
+                glBindBuffer(GL_ARRAY_BUFFER, lines);
+                attribute(program, "vPosition", 3, stride, 0, 0);
+                attribute(program, "iStart", 3, stride, 3*sizeof(float), 0);
+                attribute(program, "iEnd", 3, stride, 6*sizeof(float), 0);
+                attribute(program, "iRadius", 1, stride, 9*sizeof(float), 0);
+                attribute(program, "iDepth", 1, stride, 10*sizeof(float), 0);
+                glDrawArrays(GL_LINES, 0, 2*instances);
+            }
+            for(const char* name : {"vPosition", "iStart", "iEnd", "iRadius", "iDepth"})
+                gpu::release(program, name);
+        }
+        void release() {
+            for(GLuint* b : {&cylinder, &cylinderIndices, &starts, &ends, &radii, &depths, &lines}) {
+                if(*b) glDeleteBuffers(1, b);
+                *b = 0;
+            }
+            instances = 0;
+        }
+    };
+
+    // unit cube, centred on the origin
+    const float cubeVertices[] = {
+        // front
+        -0.5, -0.5,  0.5,
+         0.5, -0.5,  0.5,
+         0.5,  0.5,  0.5,
+        -0.5,  0.5,  0.5,
+        // back
+        -0.5, -0.5, -0.5,
+         0.5, -0.5, -0.5,
+         0.5,  0.5, -0.5,
+        -0.5,  0.5, -0.5
+    };
+    const unsigned short cubeElements[] = {
+        // front
+        0, 1, 2,
+        2, 3, 0,
+        // right
+        1, 5, 6,
+        6, 2, 1,
+        // back
+        7, 6, 5,
+        5, 4, 7,
+        // left
+        4, 0, 3,
+        3, 7, 4,
+        // bottom
+        4, 5, 1,
+        1, 0, 4,
+        // top
+        3, 2, 6,
+        6, 7, 3
+    };
+
+    // offsets (xyz triples) of voxels above 'threshold', centred in x & y
+    std::vector<float> voxelOffsets(const sampler::grid<float>& g, float threshold) {
+        std::vector<float> offsets;
+        for(size_t n = 0; n < g.size(); ++n) {
+            if(g[n] > threshold) {
+                int i, j, k;
+                g.coords(n,i,j,k);
+                offsets.insert(offsets.end(), {(float)i-(float)g.getWidth()/2.0f,
+                    (float)j-(float)g.getHeight()/2.0f, (float)k});
+            }
+        }
+        return offsets;
+    }
+    std::vector<float> voxelOffsets(const sampler::sparseGrid<float>& g, float threshold) {
+        std::vector<float> offsets;
+        g.forEach([&](int i, int j, int k, float v) {
+            if(v > threshold) {
+                offsets.insert(offsets.end(), {(float)i-(float)g.getWidth()/2.0f,
+                    (float)j-(float)g.getHeight()/2.0f, (float)k});
+            }
+        });
+        return offsets;
+    }
+
+    // filled voxels, drawn with shaders/voxel_vertex.glsl: one instanced
+    // draw of the cube per voxel offset, or without instancing a merged
+    // static mesh of all cubes, drawn in batches of 16-bit indices
+    class voxelMesh {
+        static constexpr size_t batch = 65536/8;
+        GLuint cube = 0, cubeIndices = 0, offsets = 0;
+        GLuint merged = 0, mergedIndices = 0;
+        GLsizei instances = 0;
+        bool instanced = false;
+    public:
+        void upload(const std::vector<float>& offs) {
+            release();
+            instances = offs.size()/3;
+            instanced = (drawElementsInstanced != nullptr);
+            if(instanced) {
+                cube = buffer(GL_ARRAY_BUFFER, cubeVertices, sizeof(cubeVertices));
+                cubeIndices = buffer(GL_ELEMENT_ARRAY_BUFFER, cubeElements, sizeof(cubeElements));
+                offsets = buffer(GL_ARRAY_BUFFER, offs.data(), offs.size()*sizeof(float));
+            }
+            else {
+                // (vPosition, iOffset) per cube corner; every batch shares
+                // the indices of its first 'batch' cubes
+                std::vector<float> verts;
+                verts.reserve(48*instances);
+                for(GLsizei c = 0; c < instances; ++c) {
+                    for(int v = 0; v < 8; ++v) {
+                        verts.insert(verts.end(), cubeVertices+3*v, cubeVertices+3*v+3);
+                        verts.insert(verts.end(), offs.begin()+3*c, offs.begin()+3*c+3);
+                    }
+                }
+                std::vector<unsigned short> idx;
+                size_t cubes = std::min(batch, (size_t)instances);
+                idx.reserve(36*cubes);
+                for(size_t c = 0; c < cubes; ++c) {
+                    for(unsigned short e : cubeElements)
+                        idx.push_back(8*c + e);
+                }
+                merged = buffer(GL_ARRAY_BUFFER, verts.data(), verts.size()*sizeof(float));
+                mergedIndices = buffer(GL_ELEMENT_ARRAY_BUFFER, idx.data(),
+                    idx.size()*sizeof(unsigned short));
+            }
+        }
+        void draw(GLuint program) const {
+            if(instances == 0) return;
+            if(instanced) {
+                glBindBuffer(GL_ARRAY_BUFFER, cube);
+                attribute(program, "vPosition", 3, 0, 0, 0);
+                glBindBuffer(GL_ARRAY_BUFFER, offsets);
+                attribute(program, "iOffset", 3, 0, 0, 1);
+                glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, cubeIndices);
+                drawElementsInstanced(GL_TRIANGLES, 36, GL_UNSIGNED_SHORT,
+                    nullptr, instances);
+            }
+            else {
+                GLsizei stride = 6*sizeof(float);
+                glBindBuffer(GL_ARRAY_BUFFER, merged);
+                glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mergedIndices);
+                for(size_t first = 0; first < (size_t)instances; first += batch) {
+                    size_t base = first*8*stride;
+                    attribute(program, "vPosition", 3, stride, base, 0);
+                    attribute(program, "iOffset", 3, stride, base + 3*sizeof(float), 0);
+                    GLsizei cubes = std::min(batch, instances-first);
+                    glDrawElements(GL_TRIANGLES, 36*cubes, GL_UNSIGNED_SHORT, nullptr);
+                }
+            }
+            gpu::release(program, "vPosition");
+            gpu::release(program, "iOffset");
+        }
+        void release() {
+            for(GLuint* b : {&cube, &cubeIndices, &offsets, &merged, &mergedIndices}) {
+                if(*b) glDeleteBuffers(1, b);
+                *b = 0;
+            }
+            instances = 0;
+        }
+    };
+
+    // indexed mesh, drawn with shaders/mesh_*.glsl. ES 2.0 only promises
+    // 16-bit indices, so the mesh is split into chunks of at most 65536
+    // vertices, each drawn with one call.
+    class meshBuffer {
+        struct chunk {
+            GLuint vertices, indices;
+            GLsizei count;
+        };
+        std::vector<chunk> chunks;
+    public:
+        void upload(const mesher::mesh& m) {
+            release();
+            // global vertex -> chunk vertex, valid where stamp matches
+            std::vector<uint32_t> local(m.vertices()), stamp(m.vertices(), 0);
+            std::vector<float> verts;
+            std::vector<unsigned short> idx;
+            uint32_t current = 1;
+            auto flush = [&]() {
+                if(idx.empty()) return;
+                chunks.push_back(chunk{
+                    buffer(GL_ARRAY_BUFFER, verts.data(), verts.size()*sizeof(float)),
+                    buffer(GL_ELEMENT_ARRAY_BUFFER, idx.data(), idx.size()*sizeof(unsigned short)),
+                    (GLsizei)idx.size()});
+                verts.clear(); idx.clear();
+                ++current;
+            };
+            for(size_t t = 0; t < m.indices.size(); t += 3) {
+                // room for three more vertices in this chunk?
+                if(verts.size()/6 + 3 > 65536) flush();
+                for(int c = 0; c < 3; ++c) {
+                    uint32_t v = m.indices[t+c];
+                    if(stamp[v] != current) {
+                        stamp[v] = current;
+                        local[v] = verts.size()/6;
+                        verts.insert(verts.end(), m.positions.begin()+3*v, m.positions.begin()+3*v+3);
+                        verts.insert(verts.end(), m.normals.begin()+3*v, m.normals.begin()+3*v+3);
+                    }
+                    idx.push_back(local[v]);
+                }
+            }
+            flush();
+        }
+        void release() {
+            for(const auto& c : chunks) {
+                glDeleteBuffers(1, &c.vertices);
+                glDeleteBuffers(1, &c.indices);
+            }
+            chunks.clear();
+        }
+        void draw(GLuint program) const {
+            GLsizei stride = 6*sizeof(float);
+            for(const auto& c : chunks) {
+                glBindBuffer(GL_ARRAY_BUFFER, c.vertices);
+                glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, c.indices);
+                attribute(program, "vPosition", 3, stride, 0, 0);
+                attribute(program, "vNormal", 3, stride, 3*sizeof(float), 0);
+                glDrawElements(GL_TRIANGLES, c.count, GL_UNSIGNED_SHORT, nullptr);
+            }
+            gpu::release(program, "vPosition");
+            gpu::release(program, "vNormal");
+        }
+    };
+}
+
+#define GPU_HPP
+#endif
@@ -4,25 +4,36 @@
 
 #ifndef GRAMMAR_HPP
 
+#include <algorithm>
 #include <cmath>
 #include <vector>
 #include <functional>
 #include <unordered_map>
 #include <memory>
+#include <cstdint>
+#include <cstring>
 
 #include "parse.hpp"
+#include "parallel.hpp"
+#include "stats.hpp"
+#include "philox.hpp"
 
 namespace grammar {
     // module - letter/symbol, and symbolic parameters
     class module {
         char letter;
         std::vector<char> params;
+        // index into grammar::modules
+        uint16_t id;
     public:
-        module(char letter, std::vector<char> params) 
-            : letter(letter), params(params) {}
+        module(char letter, std::vector<char> params, uint16_t id = 0) 
+            : letter(letter), params(params), id(id) {}
         const char& getLetter() const {
             return letter;
         }
+        uint16_t getId() const {
+            return id;
+        }
         const std::vector<char>& getParams() const {
             return params;
         }
@@ -36,14 +47,91 @@ namespace grammar {
         evaluation(std::shared_ptr<module> pModule, const std::vector<double>& vals)
             : m(pModule), vals(vals) {}
         const char& getLetter() const { return m->getLetter(); }
+        uint16_t getId() const { return m->getId(); }
         const std::vector<char>& getParams() const { return m->getParams(); }
         const std::vector<double>& getVals() const { return vals; }
     };
     using word = std::vector<evaluation>;
+    // size of, or position in, a packed word
+    struct extent {
+        size_t modules = 0;
+        size_t vals = 0;
+    };
+    // packed word - structure of arrays: module ids, and offsets into one
+    // contiguous parameter pool; offsets carries a trailing end offset, so
+    // module i owns pool[offsets[i], offsets[i+1])
+    class packedWord {
+    public:
+        std::vector<uint16_t> ids;
+        std::vector<uint32_t> offsets{0};
+        std::vector<double> pool;
+
+        size_t size() const { return ids.size(); }
+        char getLetter(size_t i) const { return modules[ids[i]]->getLetter(); }
+        const double* getVals(size_t i) const { return pool.data() + offsets[i]; }
+        size_t getValCount(size_t i) const { return offsets[i+1] - offsets[i]; }
+        // bytes held by the three arrays
+        size_t bytes() const {
+            return ids.capacity()*sizeof(uint16_t) 
+                + offsets.capacity()*sizeof(uint32_t)
+                + pool.capacity()*sizeof(double);
+        }
+        void clear() {
+            ids.clear();
+            offsets.assign(1,0);
+            pool.clear();
+        }
+        // size to 'e', for filling in place
+        void resize(const extent& e) {
+            ids.resize(e.modules);
+            offsets.resize(e.modules+1);
+            offsets[0] = 0;
+            pool.resize(e.vals);
+        }
+        void push(uint16_t id, const double* vals, size_t count) {
+            ids.push_back(id);
+            pool.insert(pool.end(), vals, vals+count);
+            offsets.push_back(pool.size());
+        }
+        // copy modules [first, last) of 'w' to position 'at', advancing it
+        void copy(const packedWord& w, size_t first, size_t last, extent& at) {
+            std::copy(w.ids.begin()+first, w.ids.begin()+last, ids.begin()+at.modules);
+            uint32_t shift = at.vals - w.offsets[first];
+            for(size_t i = first+1; i <= last; ++i)
+                offsets[at.modules+i-first] = w.offsets[i] + shift;
+            std::copy(w.pool.begin()+w.offsets[first], w.pool.begin()+w.offsets[last],
+                pool.begin()+at.vals);
+            at.modules += last-first;
+            at.vals += w.offsets[last] - w.offsets[first];
+        }
+        void swap(packedWord& w) {
+            ids.swap(w.ids);
+            offsets.swap(w.offsets);
+            pool.swap(w.pool);
+        }
+    };
+    packedWord pack(const word& w) {
+        packedWord pw;
+        for(const auto& e : w)
+            pw.push(e.getId(), e.getVals().data(), e.getVals().size());
+        return pw;
+    }
+    word unpack(const packedWord& pw) {
+        word w;
+        w.reserve(pw.size());
+        for(size_t i = 0; i < pw.size(); ++i) {
+            const double* vals = pw.getVals(i);
+            w.push_back(evaluation(modules[pw.ids[i]],
+                std::vector<double>(vals, vals + pw.getValCount(i))));
+        }
+        return w;
+    }
     // blueprint - module, and symbolic parameters to be evaluated into an evaluation
     class blueprint {
         std::shared_ptr<module> m;
         std::vector<std::string> evals;
+        // compiled evals, reading the rewritten evaluation's values directly
+        std::vector<parse::expression> exprs;
     public:
         blueprint(std::shared_ptr<module> pModule, 
             const std::vector<std::string>& evals) 
@@ -52,87 +140,942 @@ namespace grammar {
         const char& getLetter() const {
             return m->getLetter();
         }
-        evaluation evaluate(const std::vector<char>& params,
-                const std::vector<double>& vals) const {
-            std::vector<double> passVals(m->getParams().size(),0);
+        uint16_t getId() const {
+            return m->getId();
+        }
+        const std::vector<std::string>& getEvals() const {
+            return evals;
+        }
+        const std::vector<parse::expression>& getExpressions() const {
+            return exprs;
+        }
+        // compile evals once, for rewriting a module with parameters
+        // 'params'; names in 'context' read the values after those
+        void compile(const std::vector<char>& params,
+            const std::vector<char>& context = std::vector<char>())
+        {
             // match parameter names
-            for(int i = 0; i < m->getParams().size(); ++i) {
-                for(int j = 0; j < params.size(); ++j) {
+            std::vector<int> slots(m->getParams().size(),-1);
+            for(int i = 0; i < (int)m->getParams().size(); ++i) {
+                for(int j = 0; j < (int)params.size(); ++j) {
                     if(m->getParams()[i] == params[j]) {
-                        passVals[i] = vals[j];
+                        slots[i] = j;
                     }
                 }
             }
-            // pass matched values to user-specified arithmetic expressions
-            std::vector<double> newVals = passVals;
-            for(int i = 0; i < passVals.size(); ++i)
-                newVals[i] = parse::evaluateArithmetic(evals[i], m->getParams(), passVals);
+            // context values follow the module's own; names the module
+            // doesn't share are left to the context's
+            std::vector<char> names = m->getParams();
+            for(size_t i = 0; i < names.size(); ++i)
+                if(slots[i] < 0) names[i] = '\0';
+            names.insert(names.end(), context.begin(), context.end());
+            for(int k = 0; k < (int)context.size(); ++k)
+                slots.push_back(params.size() + k);
+            // user-specified arithmetic expressions, on matched values
+            exprs.clear();
+            for(int i = 0; i < (int)m->getParams().size(); ++i) {
+                exprs.push_back(parse::expression(evals[i], names));
+                exprs.back().remap(slots);
+            }
+        }
+        evaluation evaluate(const double* vals) const {
+            std::vector<double> newVals(exprs.size());
+            for(int i = 0; i < (int)exprs.size(); ++i)
+                newVals[i] = exprs[i].evaluate(vals);
             return evaluation(m,newVals);
         }
+        // evaluate straight into a presized packed word at 'at', advancing it
+        void evaluate(const double* vals, packedWord& w, extent& at) const {
+            w.ids[at.modules++] = m->getId();
+            for(const auto& ex : exprs)
+                w.pool[at.vals++] = ex.evaluate(vals);
+            w.offsets[at.modules] = at.vals;
+        }
+        // write only the module id at 'at', advancing it past the values,
+        // which evaluate(in, n, ...) fills in later
+        void place(packedWord& w, extent& at) const {
+            w.ids[at.modules++] = m->getId();
+            at.vals += exprs.size();
+            w.offsets[at.modules] = at.vals;
+        }
+        // evaluate 'n' modules' values at once, laid out in lanes as
+        // parse::expression reads them, into the presized packed word at
+        // pool offsets 'vals[l]'
+        void evaluate(const double* in, int n, const size_t* vals, packedWord& w) const {
+            double out[parse::expression::maxLanes];
+            for(size_t e = 0; e < exprs.size(); ++e) {
+                exprs[e].evaluate(in, n, out);
+                for(int l = 0; l < n; ++l)
+                    w.pool[vals[l] + e] = out[l];
+            }
+        }
+        size_t getValCount() const {
+            return exprs.size();
+        }
+    };
+    // context of a context-sensitive rule: the neighbouring module it
+    // requires, and names for its parameters
+    struct context {
+        std::shared_ptr<module> m;
+        std::vector<char> names;
     };
+
     // production rule: conditional map from evaluation -> word
     // calling code: if production.condition(eval), 
     //               then substitute production.rewrite(eval)
+    // A rule with left and/or right context also requires those neighbours
+    // (see neighbours below); its conditions and expressions see the
+    // module's values followed by the left, then the right context's.
     class production {
         std::shared_ptr<module> m;
         // lex'ed condition strings on evaluation's values
         std::vector<std::string> conds;
+        // compiled conditions
+        std::vector<parse::expression> tests;
         // vector of parameterized modules
         std::vector<blueprint> blueprints;
+        // selection weight among a letter's matching rules, < 0 if the
+        // rule is deterministic
+        double probability;
+        context left, right;
     public:
         production(std::shared_ptr<module> pModule,
             const std::vector<std::string>& conditions,
-            std::vector<blueprint>& blueprints)
-                : m(pModule), conds(conditions), blueprints(blueprints)
-            {}
+            std::vector<blueprint>& blueprints, double probability = -1,
+            const context& left = context(), const context& right = context())
+                : m(pModule), conds(conditions), blueprints(blueprints),
+                  probability(probability), left(left), right(right)
+            {
+                // compile conditions & blueprints once, against our
+                // parameters & the contexts'
+                std::vector<char> names = m->getParams(), contextNames;
+                contextNames.insert(contextNames.end(), left.names.begin(), left.names.end());
+                contextNames.insert(contextNames.end(), right.names.begin(), right.names.end());
+                names.insert(names.end(), contextNames.begin(), contextNames.end());
+                for(const auto& cs : conds)
+                    tests.push_back(parse::expression(cs, names, true));
+                for(auto& bp : this->blueprints)
+                    bp.compile(m->getParams(), contextNames);
+            }
         const char& getLetter() const {
             return m->getLetter();
         }
         const std::vector<std::string>& getConditions() const {
             return conds;
         }
+        const std::vector<parse::expression>& getTests() const {
+            return tests;
+        }
         const std::vector<blueprint>& getBlueprints() const {
             return blueprints;
         }
+        uint16_t getId() const {
+            return m->getId();
+        }
+        bool isStochastic() const {
+            return probability >= 0;
+        }
+        // weight in a stochastic choice; deterministic rules weigh 1
+        double getWeight() const {
+            return isStochastic() ? probability : 1.0;
+        }
+        bool hasContext() const {
+            return left.m || right.m;
+        }
+        // true if module i of 'w', with neighbours 'l' & 'r' (-1 for
+        // none), has this rule's context; then gathers the values its
+        // conditions & expressions read into 'vals'
+        bool inContext(const packedWord& w, size_t i, int32_t l, int32_t r,
+            std::vector<double>& vals) const
+        {
+            if(left.m && ((l < 0) || (w.ids[l] != left.m->getId())))
+                return false;
+            if(right.m && ((r < 0) || (w.ids[r] != right.m->getId())))
+                return false;
+            vals.assign(w.getVals(i), w.getVals(i) + w.getValCount(i));
+            // the names given, which may be fewer than the values held
+            vals.resize(m->getParams().size(), 0.0);
+            if(left.m) {
+                size_t n = std::min(left.names.size(), w.getValCount(l));
+                vals.insert(vals.end(), w.getVals(l), w.getVals(l) + n);
+                vals.resize(vals.size() + left.names.size() - n, 0.0);
+            }
+            if(right.m) {
+                size_t n = std::min(right.names.size(), w.getValCount(r));
+                vals.insert(vals.end(), w.getVals(r), w.getVals(r) + n);
+                vals.resize(vals.size() + right.names.size() - n, 0.0);
+            }
+            return true;
+        }
+        // number of parameter values written by one rewrite
+        size_t getValCount() const {
+            size_t count = 0;
+            for(const auto& bp : blueprints)
+                count += bp.getValCount();
+            return count;
+        }
         bool condition(const evaluation& e) const {
-            for(auto& cs : conds) {
-                if(!parse::evaluateConditional(cs, e.getParams(), e.getVals())) 
+            return condition(e.getVals().data());
+        }
+        bool condition(const double* vals) const {
+            for(const auto& t : tests) {
+                if(!t.test(vals)) 
                     return false;
             }
             return true;
         }
+        // conditions over 'n' modules' values in lanes: pass[l] is cleared
+        // where lane l fails
+        void condition(const double* in, int n, bool* pass) const {
+            for(const auto& t : tests)
+                t.test(in, n, pass);
+        }
+        bool isUnconditional() const {
+            return tests.empty();
+        }
         word rewrite(const evaluation& e) const {
             word w;
+            rewrite(e, w);
+            return w;
+        }
+        // append rewrite of 'e' to 'w'
+        void rewrite(const evaluation& e, word& w) const {
             for(const auto& bp : blueprints) {
-                w.push_back(bp.evaluate(e.getParams(), e.getVals()));
+                w.push_back(bp.evaluate(e.getVals().data()));
+            }
+        }
+        // write rewrite of a packed module's values into 'w' at 'at'
+        void rewrite(const double* vals, packedWord& w, extent& at) const {
+            for(const auto& bp : blueprints) {
+                bp.evaluate(vals, w, at);
+            }
+        }
+        // rewrite 'n' modules at once, their values in lanes, into 'w': the
+        // ids & offsets are already placed, the values go from pool offset
+        // 'vals[l]' for lane l
+        void rewrite(const double* in, int n, const size_t* vals, packedWord& w) const {
+            size_t at[parse::expression::maxLanes];
+            std::copy(vals, vals + n, at);
+            for(const auto& bp : blueprints) {
+                bp.evaluate(in, n, at, w);
+                for(int l = 0; l < n; ++l) at[l] += bp.getValCount();
             }
-            return w;
         }
     }; 
-    using rewrites = std::vector<production>;
+    // production rules, in order, with a dispatch table listing each
+    // module's (i.e. each letter's) candidate productions in order. A
+    // letter with any stochastic rule picks among its matching rules by
+    // weight, drawing from 'seed'.
+    class rewrites {
+        std::vector<production> rules;
+        std::vector<std::vector<int>> table;
+        std::vector<char> stochastic;
+        // letters with any context-sensitive rule, by id
+        std::vector<char> contextual;
+        std::vector<int> none;
+        uint64_t seed = 0;
+        // modules context matching skips over, by id
+        std::vector<char> ignored;
+        bool context = false;
+    public:
+        void push_back(const production& rule) {
+            if(table.size() <= rule.getId()) {
+                table.resize(rule.getId()+1);
+                stochastic.resize(rule.getId()+1, 0);
+                contextual.resize(rule.getId()+1, 0);
+            }
+            table[rule.getId()].push_back(rules.size());
+            stochastic[rule.getId()] |= rule.isStochastic();
+            contextual[rule.getId()] |= rule.hasContext();
+            context |= rule.hasContext();
+            rules.push_back(rule);
+        }
+        // true if any rule is context-sensitive
+        bool hasContext() const { return context; }
+        void ignore(uint16_t id) {
+            if(ignored.size() <= id) ignored.resize(id+1, 0);
+            ignored[id] = 1;
+        }
+        bool isIgnored(uint16_t id) const {
+            return (id < ignored.size()) && ignored[id];
+        }
+        void setSeed(uint64_t s) { seed = s; }
+        uint64_t getSeed() const { return seed; }
+        bool isStochastic(uint16_t id) const {
+            return (id < stochastic.size()) && stochastic[id];
+        }
+        bool isStochastic() const {
+            for(char c : stochastic)
+                if(c) return true;
+            return false;
+        }
+        // true if module 'id' is matched by its own values, first rule
+        // that holds - so many of them can be matched at once
+        bool isBatched(uint16_t id) const {
+            return (id < table.size()) && !stochastic[id] && !contextual[id];
+        }
+        size_t size() const { return rules.size(); }
+        const production& operator[](size_t r) const { return rules[r]; }
+        std::vector<production>::const_iterator begin() const { return rules.begin(); }
+        std::vector<production>::const_iterator end() const { return rules.end(); }
+        // candidate productions for module 'id', in rule order
+        const std::vector<int>& candidates(uint16_t id) const {
+            return (id < table.size()) ? table[id] : none;
+        }
+    };
+
+
+    // index of the rule rewriting a module, or -1: the first rule that
+    // holds(r) or, for a stochastic letter, a weighted pick among those
+    // that hold. The pick draws from the counter (iteration, position of
+    // the module in the word being rewritten), so it is the same however
+    // the word is split or traversed.
+    template<typename Holds>
+    int choose(uint16_t id, const rewrites& rules, uint32_t iteration,
+        uint64_t position, Holds holds)
+    {
+        const std::vector<int>& candidates = rules.candidates(id);
+        if(!rules.isStochastic(id)) {
+            for(int r : candidates) {
+                if(holds(r))
+                    return r;
+            }
+            return -1;
+        }
+        // total weight of the rules that apply, remembering which (the
+        // first 64) did, so their conditions are tested once
+        double total = 0;
+        uint64_t held = 0;
+        for(size_t c = 0; c < candidates.size(); ++c) {
+            if(holds(candidates[c])) {
+                total += rules[candidates[c]].getWeight();
+                if(c < 64) held |= uint64_t(1) << c;
+            }
+        }
+        if(total <= 0) return -1;
+        double u = philox::uniform(rules.getSeed(), iteration, position) * total;
+        int last = -1;
+        for(size_t c = 0; c < candidates.size(); ++c) {
+            int r = candidates[c];
+            bool applies = (c < 64) ? ((held >> c) & 1) : holds(r);
+            if(!applies || (rules[r].getWeight() <= 0)) continue;
+            u -= rules[r].getWeight();
+            last = r;
+            if(u < 0) break;
+        }
+        return last;
+    }
+    // match by a module's own values; context-sensitive rules never
+    // match here, as they need the module's neighbours
+    int match(uint16_t id, const double* vals, const rewrites& rules,
+        uint32_t iteration = 0, uint64_t position = 0)
+    {
+        bool context = rules.hasContext();
+        return choose(id, rules, iteration, position, [&](int r) {
+            return (!context || !rules[r].hasContext()) && rules[r].condition(vals);
+        });
+    }
+    int match(const evaluation& e, const rewrites& rules,
+        uint32_t iteration = 0, uint64_t position = 0)
+    {
+        return match(e.getId(), e.getVals().data(), rules, iteration, position);
+    }
+    int match(const packedWord& w, size_t i, const rewrites& rules,
+        uint32_t iteration = 0, uint64_t position = 0)
+    {
+        return match(w.ids[i], w.getVals(i), rules, iteration, position);
+    }
+
+    // neighbours for context matching: left[i] & right[i] index the
+    // modules beside module i on its own branch, or -1. Whole bracketed
+    // branches and ignored modules are skipped; a branch's first module
+    // sees the module before the branch on the left, and its last module
+    // has nothing on the right. Found in one linear pass each way.
+    struct neighbours {
+        std::vector<int64_t> left, right;
+    };
+    void findNeighbours(const packedWord& w, const rewrites& rules, neighbours& n) {
+        // module kinds by id: 1 '[', 2 ']', 3 ignored
+        std::vector<char> kind(modules.size(), 0);
+        for(size_t id = 0; id < modules.size(); ++id) {
+            char c = modules[id]->getLetter();
+            kind[id] = (c == '[') ? 1 : (c == ']') ? 2 : rules.isIgnored(id) ? 3 : 0;
+        }
+        size_t size = w.size();
+        n.left.assign(size, -1);
+        n.right.assign(size, -1);
+        std::vector<int64_t> stack;
+        int64_t last = -1;
+        for(size_t i = 0; i < size; ++i) {
+            char k = kind[w.ids[i]];
+            if(k == 1) stack.push_back(last);
+            else if(k == 2) {
+                // an unopened branch closing hides what came before it
+                last = stack.empty() ? -1 : stack.back();
+                if(!stack.empty()) stack.pop_back();
+            }
+            else {
+                n.left[i] = last;
+                if(k == 0) last = i;
+            }
+        }
+        stack.clear();
+        int64_t next = -1;
+        for(size_t i = size; i-- > 0; ) {
+            char k = kind[w.ids[i]];
+            if(k == 2) {
+                stack.push_back(next);
+                next = -1;
+            }
+            else if(k == 1) {
+                // as does a branch left open, for what comes after it
+                next = stack.empty() ? -1 : stack.back();
+                if(!stack.empty()) stack.pop_back();
+            }
+            else {
+                n.right[i] = next;
+                if(k == 0) next = i;
+            }
+        }
+    }
+    // match module i of 'w' with its neighbours 'n', gathering context
+    // rules' values into 'vals'
+    int match(const packedWord& w, size_t i, const rewrites& rules,
+        uint32_t iteration, const neighbours& n, std::vector<double>& vals)
+    {
+        return choose(w.ids[i], rules, iteration, i, [&](int r) {
+            const production& p = rules[r];
+            if(!p.hasContext()) return p.condition(w.getVals(i));
+            return p.inContext(w, i, n.left[i], n.right[i], vals)
+                && p.condition(vals.data());
+        });
+    }
 
-    // Parametric OL system
+    // Parametric OL system: stream the rewrite of 'axiom' into 'out'.
+    // The first pass matches rules and sizes 'out', the second pass writes
+    // it front to back - linear in word length, with no shifting.
+    // 'matches' is scratch space, kept by callers between iterations.
+    void apply(const word& axiom, const rewrites& rules, word& out,
+        std::vector<int>& matches, uint32_t iteration = 0)
+    {
+        matches.resize(axiom.size());
+        size_t size = 0;
+        for(size_t i = 0; i < axiom.size(); ++i) {
+            int r = match(axiom[i], rules, iteration, i);
+            matches[i] = r;
+            size += (r < 0) ? 1 : rules[r].getBlueprints().size();
+        }
+        out.clear();
+        out.reserve(size);
+        for(size_t i = 0; i < axiom.size(); ++i) {
+            if(matches[i] < 0) out.push_back(axiom[i]);
+            else rules[matches[i]].rewrite(axiom[i], out);
+        }
+    }
     void apply(word& axiom, rewrites& rules) {
-        // iterate over the current word
-        for(int i = 0; i < axiom.size(); ++i) {
-            evaluation& e = axiom[i];
-            char letter = e.getLetter();
-            // iterate over all the rules
-            for(const auto& rule : rules) {
-                // letter matches
-                if(rule.getLetter() == letter) {
-                    // try conditions
-                    if(rule.condition(e)) {
-                        word w = rule.rewrite(e);
-                        axiom.erase(axiom.begin()+i);
-                        axiom.insert(axiom.begin()+i, w.begin(), w.end());
-                        i += w.size()-1; break;
+        word out;
+        std::vector<int> matches;
+        apply(axiom, rules, out, matches);
+        axiom.swap(out);
+    }
+
+    // Batches: rather than evaluating conditions & expressions one module
+    // at a time, the modules of a range that share a letter (or a rule) are
+    // gathered 'lanes' at a time and each compiled expression runs once
+    // over all of them - see parse::expression. Results are the same, bit
+    // for bit: every lane does the scalar evaluation's arithmetic.
+    const int lanes = parse::expression::maxLanes;
+    // gather the values of modules 'at[0, n)' of 'w' into lanes: the first
+    // 'slots' values of lane l at in[s*lanes + l], 0 past a module's own.
+    // Lanes n and up are zeroed, as evaluation runs over every lane.
+    void gather(const packedWord& w, const size_t* at, int n, size_t slots, double* in) {
+        for(int l = 0; l < n; ++l) {
+            const double* vals = w.getVals(at[l]);
+            size_t count = std::min(slots, w.getValCount(at[l]));
+            for(size_t s = 0; s < count; ++s) in[s*lanes + l] = vals[s];
+            for(size_t s = count; s < slots; ++s) in[s*lanes + l] = 0.0;
+        }
+        for(size_t s = 0; s < slots; ++s)
+            std::fill(in + s*lanes + n, in + (s+1)*lanes, 0.0);
+    }
+    // match the modules 'group' of 'w', all of letter 'id', a batch at a
+    // time: each candidate's conditions are tested over the whole batch,
+    // and a module takes the first candidate it passes
+    void match(const packedWord& w, uint16_t id, const std::vector<size_t>& group,
+        const rewrites& rules, std::vector<int>& matches)
+    {
+        const std::vector<int>& candidates = rules.candidates(id);
+        size_t slots = modules[id]->getParams().size();
+        std::vector<double> in(std::max<size_t>(slots, 1)*lanes);
+        for(size_t b = 0; b < group.size(); b += lanes) {
+            int n = std::min<size_t>(lanes, group.size() - b);
+            gather(w, &group[b], n, slots, in.data());
+            int r[lanes];
+            std::fill(r, r + n, -1);
+            int unmatched = n;
+            for(int c : candidates) {
+                bool pass[lanes];
+                std::fill(pass, pass + n, true);
+                rules[c].condition(in.data(), n, pass);
+                for(int l = 0; l < n; ++l) {
+                    if((r[l] < 0) && pass[l]) {
+                        r[l] = c;
+                        --unmatched;
                     }
                 }
+                if(unmatched == 0) break;
             }
+            for(int l = 0; l < n; ++l) matches[group[b+l]] = r[l];
         }
     }
 
+    // Parametric OL system on packed words, in two passes over a range
+    // [first, last) of the word: count matches rules and sizes the rewrite,
+    // write fills the rewrite into a presized word from position 'at'.
+    // Context-sensitive rules need the word's neighbours 'n'.
+    extent count(const packedWord& axiom, const rewrites& rules,
+        std::vector<int>& matches, size_t first, size_t last,
+        uint32_t iteration = 0, const neighbours* n = nullptr)
+    {
+        extent size;
+        std::vector<double> vals;
+        // modules to match in batches, by letter
+        std::vector<std::vector<size_t>> groups;
+        for(size_t i = first; i < last; ++i) {
+            uint16_t id = axiom.ids[i];
+            const std::vector<int>& candidates = rules.candidates(id);
+            // modules without productions skip matching entirely, as do
+            // those whose first rule always holds
+            if(candidates.empty()) matches[i] = -1;
+            else if(rules.isBatched(id)) {
+                if(rules[candidates[0]].isUnconditional()) {
+                    matches[i] = candidates[0];
+                    continue;
+                }
+                if(groups.size() <= id) groups.resize(id+1);
+                groups[id].push_back(i);
+            }
+            else matches[i] = n ? match(axiom, i, rules, iteration, *n, vals)
+                : match(axiom, i, rules, iteration, i);
+        }
+        for(size_t id = 0; id < groups.size(); ++id) {
+            if(!groups[id].empty()) match(axiom, id, groups[id], rules, matches);
+        }
+        for(size_t i = first; i < last; ++i) {
+            int r = matches[i];
+            if(r < 0) {
+                size.modules += 1;
+                size.vals += axiom.getValCount(i);
+            }
+            else {
+                size.modules += rules[r].getBlueprints().size();
+                size.vals += rules[r].getValCount();
+            }
+        }
+        return size;
+    }
+    // the write pass places every rewrite's ids & offsets in order, then
+    // evaluates the values of each rule's rewrites in batches
+    void write(const packedWord& axiom, const rewrites& rules,
+        const std::vector<int>& matches, size_t first, size_t last,
+        packedWord& out, extent at, const neighbours* n = nullptr)
+    {
+        std::vector<double> vals;
+        // per rule: the modules it rewrites, and where their values go
+        struct batch {
+            std::vector<size_t> modules, vals;
+        };
+        std::vector<batch> batches(rules.size());
+        for(size_t i = first; i < last; ) {
+            if(matches[i] >= 0) {
+                const production& p = rules[matches[i]];
+                if(n && p.hasContext()) {
+                    p.inContext(axiom, i, n->left[i], n->right[i], vals);
+                    p.rewrite(vals.data(), out, at);
+                }
+                else {
+                    batches[matches[i]].modules.push_back(i);
+                    batches[matches[i]].vals.push_back(at.vals);
+                    for(const auto& bp : p.getBlueprints()) bp.place(out, at);
+                }
+                ++i; continue;
+            }
+            // bulk-copy runs of unrewritten modules
+            size_t j = i;
+            while((j < last)&&(matches[j] < 0)) ++j;
+            out.copy(axiom, i, j, at);
+            i = j;
+        }
+        std::vector<double> in;
+        for(size_t r = 0; r < batches.size(); ++r) {
+            const batch& b = batches[r];
+            if(b.modules.empty() || (rules[r].getValCount() == 0)) continue;
+            size_t slots = modules[rules[r].getId()]->getParams().size();
+            in.resize(std::max<size_t>(slots, 1)*lanes);
+            for(size_t k = 0; k < b.modules.size(); k += lanes) {
+                int count = std::min<size_t>(lanes, b.modules.size() - k);
+                gather(axiom, &b.modules[k], count, slots, in.data());
+                rules[r].rewrite(in.data(), count, &b.vals[k], out);
+            }
+        }
+    }
+    // rule statistics over a matched range: hits per rule, and how many
+    // conditions matching tested - worked out from 'matches' afterwards,
+    // so the count pass itself is untouched
+    struct tally {
+        std::vector<size_t> hits;
+        size_t tests = 0;
+        void merge(const tally& t) {
+            if(hits.size() < t.hits.size()) hits.resize(t.hits.size());
+            for(size_t r = 0; r < t.hits.size(); ++r) hits[r] += t.hits[r];
+            tests += t.tests;
+        }
+        void record() const {
+            stats::tally("rule hits", hits);
+            stats::count("condition tests", tests);
+        }
+    };
+    void count(const packedWord& axiom, const rewrites& rules,
+        const std::vector<int>& matches, size_t first, size_t last, tally& t)
+    {
+        t.hits.resize(rules.size());
+        for(size_t i = first; i < last; ++i) {
+            const std::vector<int>& candidates = rules.candidates(axiom.ids[i]);
+            int r = matches[i];
+            if(r >= 0) t.hits[r] += 1;
+            // unmatched & stochastic modules test every candidate
+            if((r < 0) || rules.isStochastic(axiom.ids[i])) {
+                t.tests += candidates.size();
+                continue;
+            }
+            t.tests += std::find(candidates.begin(), candidates.end(), r)
+                - candidates.begin() + 1;
+        }
+    }
+    // 'iteration' numbers the step, keying stochastic choices
+    void apply(const packedWord& axiom, const rewrites& rules, packedWord& out,
+        std::vector<int>& matches, uint32_t iteration = 0)
+    {
+        matches.resize(axiom.size());
+        neighbours n;
+        if(rules.hasContext()) findNeighbours(axiom, rules, n);
+        const neighbours* context = rules.hasContext() ? &n : nullptr;
+        out.resize(count(axiom, rules, matches, 0, axiom.size(), iteration, context));
+        write(axiom, rules, matches, 0, axiom.size(), out, extent(), context);
+        if(stats::enabled) {
+            tally t;
+            count(axiom, rules, matches, 0, axiom.size(), t);
+            t.record();
+        }
+    }
+    // parallel apply: count every chunk of the word, take an exclusive
+    // prefix sum over the chunk sizes, then write every chunk into its own
+    // slice of 'out' - the output matches the serial apply bit for bit
+    const size_t minChunk = 1 << 14;
+    void apply(const packedWord& axiom, const rewrites& rules, packedWord& out,
+        std::vector<int>& matches, parallel::pool& threads, uint32_t iteration = 0)
+    {
+        size_t n = axiom.size();
+        size_t chunks = std::min(n/minChunk, 4*threads.size());
+        if(chunks < 2) {
+            apply(axiom, rules, out, matches, iteration);
+            return;
+        }
+        matches.resize(n);
+        // neighbours of the whole word, so chunks see across their ends
+        neighbours nb;
+        if(rules.hasContext()) findNeighbours(axiom, rules, nb);
+        const neighbours* context = rules.hasContext() ? &nb : nullptr;
+        std::vector<extent> at(chunks+1);
+        threads.run(chunks, [&](size_t c) {
+            at[c+1] = count(axiom, rules, matches, n*c/chunks, n*(c+1)/chunks,
+                iteration, context);
+        });
+        for(size_t c = 1; c <= chunks; ++c) {
+            at[c].modules += at[c-1].modules;
+            at[c].vals += at[c-1].vals;
+        }
+        out.resize(at[chunks]);
+        threads.run(chunks, [&](size_t c) {
+            write(axiom, rules, matches, n*c/chunks, n*(c+1)/chunks, out, at[c], context);
+        });
+        if(stats::enabled) {
+            // tallied per chunk, merged & recorded once
+            std::vector<tally> tallies(chunks);
+            threads.run(chunks, [&](size_t c) {
+                count(axiom, rules, matches, n*c/chunks, n*(c+1)/chunks, tallies[c]);
+            });
+            for(size_t c = 1; c < chunks; ++c) tallies[0].merge(tallies[c]);
+            tallies[0].record();
+        }
+    }
+
+    // double-buffered derivation: each step writes the back word from the
+    // front word, then swaps them, so buffers are reused across iterations
+    class derivation {
+        packedWord front, back;
+        std::vector<int> matches;
+        parallel::pool* threads;
+        uint32_t iteration = 0;
+    public:
+        // derive on 'threads', if given
+        derivation(const word& axiom, parallel::pool* threads = nullptr)
+            : front(pack(axiom)), threads(threads)
+            {}
+        void step(const rewrites& rules) {
+            ++iteration;
+            if(threads) apply(front, rules, back, matches, *threads, iteration);
+            else apply(front, rules, back, matches, iteration);
+            front.swap(back);
+        }
+        const packedWord& current() const {
+            return front;
+        }
+        // bytes held by both buffers & the match scratch
+        size_t bytes() const {
+            return front.bytes() + back.bytes() + matches.capacity()*sizeof(int);
+        }
+    };
+
+    // depth-first derivation: expands the axiom 'depth' times and yields
+    // the derived word one module at a time, without ever materializing it.
+    // Only one rewrite per level is held, so memory is O(depth x longest
+    // production) rather than O(derived word length). A module's
+    // neighbours aren't known here, so context-sensitive rules never apply.
+    class generator {
+        const rewrites& rules;
+        // level d holds the rewrite being walked at derivation depth d
+        struct level {
+            packedWord w;
+            size_t next = 0;
+        };
+        std::vector<level> levels;
+        int top = 0;
+        // for stochastic rules: positions[d] is where the next module
+        // walked at depth d sits in the word of iteration d, so choices
+        // match the flat derivation's
+        bool stochastic;
+        std::vector<uint64_t> positions;
+    public:
+        generator(const packedWord& axiom, const rewrites& rules, int depth)
+            : rules(rules), levels(depth+1), stochastic(rules.isStochastic()),
+              positions(stochastic ? depth+1 : 0)
+        {
+            levels[0].w = axiom;
+        }
+        // fetch the next module of the derived word; 'vals' stays valid
+        // until the following call. false once the word is exhausted.
+        bool next(uint16_t& id, const double*& vals, size_t& count) {
+            while(top >= 0) {
+                level& lv = levels[top];
+                if(lv.next == lv.w.size()) {
+                    --top; continue;
+                }
+                size_t i = lv.next++;
+                uint64_t position = stochastic ? positions[top]++ : 0;
+                int r = (top+1 == (int)levels.size()) ? -1
+                    : match(lv.w, i, rules, top+1, position);
+                // at full depth, or a module no rule rewrites (which then
+                // stays as it is for every remaining iteration)
+                if(r < 0) {
+                    if(stochastic) {
+                        for(size_t d = top+1; d < positions.size(); ++d)
+                            positions[d] += 1;
+                    }
+                    id = lv.w.ids[i];
+                    vals = lv.w.getVals(i);
+                    count = lv.w.getValCount(i);
+                    return true;
+                }
+                level& child = levels[++top];
+                extent at, size;
+                size.modules = rules[r].getBlueprints().size();
+                size.vals = rules[r].getValCount();
+                child.w.resize(size);
+                child.next = 0;
+                rules[r].rewrite(lv.w.getVals(i), child.w, at);
+            }
+            return false;
+        }
+    };
+
+    // memoized derivation: the expansion of a module, with given values, over
+    // a given number of remaining iterations is derived once and stored as
+    // a fragment, which every later occurrence references - the derived
+    // word becomes a DAG of shared fragments rather than a flat word.
+    // Stochastic choices depend on a module's position, which a shared
+    // fragment does not have: derive stochastic grammars flat or streamed.
+    // Context-sensitive rules depend on neighbours, so derive them flat.
+    // Each fragment also records which letters' rules its derivation
+    // consulted, so that after rules change only the fragments depending
+    // on them need deriving again (see invalidate).
+    class expansion {
+        // fragment: a single module of the derived word (leaf >= 0), or
+        // the sequence of fragments edges[first, first+count)
+        struct fragment {
+            int32_t leaf;
+            uint32_t first, count;
+            size_t length;
+            // key: module id, its values, and remaining iterations
+            uint16_t id;
+            int depth;
+            uint32_t key;
+        };
+        const rewrites& rules;
+        std::vector<fragment> fragments;
+        std::vector<uint32_t> edges;
+        packedWord leaves;
+        packedWord keys;
+        std::unordered_multimap<uint64_t, uint32_t> cache;
+        // per fragment, a bit set over module ids of the letters whose
+        // rules were matched anywhere in its derivation, 'stride' words each
+        size_t stride;
+        std::vector<uint64_t> deps;
+        void depend(const fragment& f) {
+            size_t at = deps.size();
+            deps.resize(at + stride, 0);
+            if(f.depth > 0) deps[at + f.id/64] |= uint64_t(1) << (f.id%64);
+            for(uint32_t e = f.first; e < f.first + f.count; ++e) {
+                for(size_t k = 0; k < stride; ++k)
+                    deps[at + k] |= deps[(size_t)edges[e]*stride + k];
+            }
+        }
+        static uint64_t hash(uint16_t id, const double* vals, size_t count, int depth) {
+            uint64_t h = 1469598103934665603ull;
+            auto mix = [&h](uint64_t v) { h = (h ^ v) * 1099511628211ull; };
+            mix(id); mix(depth);
+            for(size_t i = 0; i < count; ++i) {
+                uint64_t bits;
+                std::memcpy(&bits, vals+i, sizeof(bits));
+                mix(bits);
+            }
+            return h;
+        }
+        uint32_t add(fragment f, uint16_t id, const double* vals, size_t count,
+            int depth, uint64_t h)
+        {
+            f.id = id; f.depth = depth; f.key = keys.size();
+            keys.push(id, vals, count);
+            depend(f);
+            fragments.push_back(f);
+            cache.emplace(h, fragments.size()-1);
+            return fragments.size()-1;
+        }
+    public:
+        expansion(const rewrites& rules)
+            : rules(rules), stride(std::max<size_t>(1, (modules.size()+63)/64))
+            {}
+        // fragment for module 'id' with 'vals', derived 'depth' more times
+        uint32_t expand(uint16_t id, const double* vals, size_t count, int depth) {
+            uint64_t h = hash(id, vals, count, depth);
+            auto range = cache.equal_range(h);
+            for(auto it = range.first; it != range.second; ++it) {
+                const fragment& f = fragments[it->second];
+                if((f.id == id)&&(f.depth == depth)
+                    &&(keys.getValCount(f.key) == count)
+                    &&(std::memcmp(keys.getVals(f.key), vals, count*sizeof(double)) == 0))
+                    return it->second;
+            }
+            int r = (depth > 0) ? match(id, vals, rules) : -1;
+            if(r < 0) {
+                fragment f{(int32_t)leaves.size(), 0, 0, 1, 0, 0, 0};
+                leaves.push(id, vals, count);
+                return add(f, id, vals, count, depth, h);
+            }
+            // rewrite once, then expand every successor module
+            packedWord w;
+            extent at, size;
+            size.modules = rules[r].getBlueprints().size();
+            size.vals = rules[r].getValCount();
+            w.resize(size);
+            rules[r].rewrite(vals, w, at);
+            std::vector<uint32_t> children;
+            for(size_t i = 0; i < w.size(); ++i)
+                children.push_back(expand(w.ids[i], w.getVals(i), w.getValCount(i), depth-1));
+            fragment f{-1, (uint32_t)edges.size(), (uint32_t)children.size(), 0, 0, 0, 0};
+            for(uint32_t c : children)
+                f.length += fragments[c].length;
+            edges.insert(edges.end(), children.begin(), children.end());
+            return add(f, id, vals, count, depth, h);
+        }
+        // fragment for the whole axiom, derived 'depth' times
+        uint32_t expand(const packedWord& axiom, int depth) {
+            std::vector<uint32_t> children;
+            for(size_t i = 0; i < axiom.size(); ++i)
+                children.push_back(expand(axiom.ids[i], axiom.getVals(i), axiom.getValCount(i), depth));
+            fragment f{-1, (uint32_t)edges.size(), (uint32_t)children.size(), 0, 0, 0, 0};
+            for(uint32_t c : children)
+                f.length += fragments[c].length;
+            edges.insert(edges.end(), children.begin(), children.end());
+            f.id = 0; f.depth = 0; f.key = 0;
+            depend(f);
+            f.depth = depth;
+            fragments.push_back(f);
+            return fragments.size()-1;
+        }
+        // forget the fragments whose derivation consulted the rules of a
+        // letter in 'changed' (by id), so expanding again derives them
+        // under the rules as they are now; the others are reused as they
+        // are. Forgotten fragments stay stored, unreachable from new roots.
+        // Returns how many were forgotten.
+        size_t invalidate(const std::vector<char>& changed) {
+            std::vector<uint64_t> mask(stride, 0);
+            for(size_t id = 0; (id < changed.size()) && (id < 64*stride); ++id)
+                if(changed[id]) mask[id/64] |= uint64_t(1) << (id%64);
+            size_t forgotten = 0;
+            for(auto it = cache.begin(); it != cache.end(); ) {
+                const uint64_t* d = deps.data() + (size_t)it->second*stride;
+                bool dirty = false;
+                for(size_t k = 0; k < stride; ++k) dirty |= (d[k] & mask[k]) != 0;
+                if(dirty) {
+                    it = cache.erase(it);
+                    ++forgotten;
+                }
+                else ++it;
+            }
+            return forgotten;
+        }
+        // fragments that later expansions can still reuse
+        size_t reusable() const {
+            return cache.size();
+        }
+        // modules in the derived word of fragment 'f'
+        size_t length(uint32_t f) const {
+            return fragments[f].length;
+        }
+        // distinct fragments stored
+        size_t size() const {
+            return fragments.size();
+        }
+        // visit the derived word of fragment 'root' in order, as
+        // visit(id, vals, count), without flattening it
+        template<typename Visitor>
+        void walk(uint32_t root, Visitor visit) const {
+            std::vector<std::pair<uint32_t,uint32_t>> stack{{root,0}};
+            while(!stack.empty()) {
+                auto& top = stack.back();
+                const fragment& f = fragments[top.first];
+                if(f.leaf >= 0) {
+                    visit(leaves.ids[f.leaf], leaves.getVals(f.leaf), leaves.getValCount(f.leaf));
+                    stack.pop_back(); continue;
+                }
+                if(top.second == f.count) {
+                    stack.pop_back(); continue;
+                }
+                uint32_t child = edges[f.first + top.second++];
+                stack.push_back({child,0});
+            }
+        }
+        // flatten fragment 'root' into a packed word
+        packedWord flatten(uint32_t root) const {
+            packedWord w;
+            walk(root, [&w](uint16_t id, const double* vals, size_t count) {
+                w.push(id, vals, count);
+            });
+            return w;
+        }
+    };
+
     // print an evaluate string of modules
     std::string wordToString(const word& w) {
         std::stringstream buffer;
@@ -149,6 +1092,21 @@ namespace grammar {
         }
         return buffer.str();
     }
+    std::string wordToString(const packedWord& w) {
+        std::stringstream buffer;
+        for(size_t i = 0; i < w.size(); ++i) {
+            buffer << w.getLetter(i);
+            size_t count = w.getValCount(i);
+            if(count > 0) {
+                const double* vals = w.getVals(i);
+                buffer << "(";
+                for(size_t ii = 0; ii < count-1; ++ii) 
+                    buffer << vals[ii] << ",";
+                buffer << vals[count-1] << ")";
+            }
+        }
+        return buffer.str();
+    }
 }
 
 #define GRAMMAR_HPP
@@ -0,0 +1,213 @@
+// incremental.hpp
+// ---------------
+// Incremental re-derivation, for tuning a specification interactively: a
+// session keeps the memoized derivation, the segments and the voxel grid
+// between reloads, and on each reload derives again only the fragments
+// whose letters' rules changed, then resamples only the segments that
+// moved. Stochastic and context-sensitive grammars can't be memoized, so
+// they are derived flat each time; their voxels are still updated in place.
+
+#ifndef INCREMENTAL_HPP
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "grammar.hpp"
+#include "turtle.hpp"
+#include "sampler.hpp"
+#include "parallel.hpp"
+#include "pipeline.hpp"
+#include "stats.hpp"
+
+namespace incremental {
+    // the module table as text: letters and parameter names, by id
+    std::string table() {
+        std::string s;
+        for(const auto& m : grammar::modules) {
+            s += m->getLetter();
+            s.append(m->getParams().begin(), m->getParams().end());
+            s += '\0';
+        }
+        return s;
+    }
+    // the rules of letter 'id' as text, so a changed rule (or a rule added
+    // or removed) changes it
+    std::string signature(const grammar::rewrites& rules, uint16_t id) {
+        std::string s;
+        for(int r : rules.candidates(id)) {
+            const grammar::production& p = rules[r];
+            char weight[32];
+            std::snprintf(weight, sizeof(weight), "%.17g", p.getWeight());
+            s += weight;
+            s += '\0';
+            for(const auto& c : p.getConditions()) s += c + '\0';
+            s += '\1';
+            for(const auto& bp : p.getBlueprints()) {
+                s += std::to_string(bp.getId()) + '(';
+                for(const auto& e : bp.getEvals()) s += e + '\0';
+                s += ')';
+            }
+            s += '\2';
+        }
+        return s;
+    }
+
+    // segments of 'a' not in 'b' ('removed') and of 'b' not in 'a' ('added'),
+    // by start & end point, counting duplicates. Runs both share at the
+    // front and back are skipped; the rest are sorted and merged.
+    void difference(const turtle::segments& a, const turtle::segments& b,
+        std::vector<size_t>& removed, std::vector<size_t>& added)
+    {
+        typedef std::array<uint32_t,6> key;
+        auto keyOf = [](const turtle::segments& s, size_t i) {
+            key k;
+            std::memcpy(k.data(), &s.start[3*i], 3*sizeof(float));
+            std::memcpy(k.data()+3, &s.end[3*i], 3*sizeof(float));
+            return k;
+        };
+        size_t front = 0, back = 0;
+        size_t n = std::min(a.size(), b.size());
+        while((front < n) && (keyOf(a, front) == keyOf(b, front))) ++front;
+        while((back < n - front)
+            && (keyOf(a, a.size()-1-back) == keyOf(b, b.size()-1-back))) ++back;
+        auto sorted = [&](const turtle::segments& s) {
+            std::vector<std::pair<key,size_t>> v;
+            v.reserve(s.size() - front - back);
+            for(size_t i = front; i < s.size() - back; ++i)
+                v.push_back({keyOf(s, i), i});
+            std::sort(v.begin(), v.end());
+            return v;
+        };
+        std::vector<std::pair<key,size_t>> x = sorted(a), y = sorted(b);
+        removed.clear(); added.clear();
+        size_t i = 0, j = 0;
+        while((i < x.size()) || (j < y.size())) {
+            if((j == y.size()) || ((i < x.size()) && (x[i].first < y[j].first)))
+                removed.push_back(x[i++].second);
+            else if((i == x.size()) || (y[j].first < x[i].first))
+                added.push_back(y[j++].second);
+            else { ++i; ++j; }
+        }
+    }
+
+    // a specification being tuned: its derivation, segments & the voxel
+    // grid sampler::img, which the session owns while in use
+    class session {
+        parallel::pool& threads;
+        int res;
+        pipeline::plant p;
+        std::string modules;
+        std::vector<std::string> signatures;
+        // derivation of p, referencing p.rules; null when derived flat
+        std::unique_ptr<grammar::expansion> ex;
+        uint32_t root = 0;
+        turtle::segments segs, previous;
+        int d = 0;
+        bool sampled = false;
+        // bring sampler::img from 'previous' to 'segs'
+        void resample() {
+            int scale = std::max(pipeline::scale(segs), 1);
+            std::vector<size_t> removed, added;
+            if(sampled && (scale == d)) difference(previous, segs, removed, added);
+            // moving most segments costs more than sampling them all
+            if(!sampled || (scale != d) || (removed.size() + added.size() >= segs.size())) {
+                d = scale;
+                pipeline::voxelize(segs, d, res);
+                sampled = true;
+                std::cout << "(incremental) resampled " << segs.size() << " segments\n";
+                return;
+            }
+            stats::scope timer("voxelize");
+            for(size_t s : removed)
+                sampler::removeSegment(sampler::img, previous.getStart(s), previous.getEnd(s));
+            for(size_t s : added)
+                sampler::sampleSegment(sampler::img, segs.getStart(s), segs.getEnd(s));
+            stats::count("segments resampled", removed.size() + added.size());
+            std::cout << "(incremental) " << removed.size() << " segments out, "
+                      << added.size() << " in, of " << segs.size() << "\n";
+        }
+    public:
+        // voxelize at 'res' voxels a side, deriving flat on 'threads'
+        session(parallel::pool& threads, int res = 32)
+            : threads(threads), res(res)
+            {}
+        session(const session&) = delete;
+        session& operator=(const session&) = delete;
+
+        // derive 'next' 'iter' times, reusing what the last update derived
+        // under rules that haven't changed since, and update the segments
+        // and sampler::img to match
+        void update(const pipeline::plant& next, int iter) {
+            stats::scope timer("update");
+            std::string nextModules = table();
+            std::vector<std::string> nextSignatures(grammar::modules.size());
+            for(size_t id = 0; id < grammar::modules.size(); ++id)
+                nextSignatures[id] = signature(next.rules, id);
+            bool memo = !next.rules.isStochastic() && !next.rules.hasContext();
+
+            // forget what changed rules derived; start over if the module
+            // table changed, or forgotten fragments outnumber the rest
+            std::vector<char> changed(nextSignatures.size(), 0);
+            size_t letters = nextSignatures.size(), forgotten = 0;
+            bool fresh = !memo || !ex || (nextModules != modules);
+            if(!fresh) {
+                letters = 0;
+                for(size_t id = 0; id < changed.size(); ++id) {
+                    changed[id] = nextSignatures[id] != signatures[id];
+                    letters += changed[id];
+                }
+                forgotten = ex->invalidate(changed);
+                fresh = ex->size() - ex->reusable() > ex->reusable();
+            }
+            p.axiom = next.axiom;
+            p.iter = next.iter;
+            p.rules = next.rules;
+            modules = nextModules;
+            signatures = nextSignatures;
+            if(fresh) ex.reset(memo ? new grammar::expansion(p.rules) : nullptr);
+
+            previous.swap(segs);
+            if(ex) {
+                size_t before = ex->size();
+                root = ex->expand(grammar::pack(p.axiom), iter);
+                size_t derived = ex->size() - before - 1;
+                stats::count("fragments derived", derived);
+                std::cout << "(incremental) " << letters << " of " << signatures.size()
+                          << " letters' rules changed: " << forgotten << " fragments forgotten, "
+                          << derived << " derived, " << ex->reusable() - derived << " kept\n";
+                stats::scope interpretTimer("interpret");
+                turtle::interpret(*ex, root, segs);
+            }
+            else {
+                pipeline::logging quiet;
+                quiet.level = pipeline::verbosity::quiet;
+                pipeline::derive(p, iter, pipeline::mode::flat, threads, segs, quiet);
+            }
+            resample();
+        }
+        // load 'filename' and update to it, deriving 'iter' times (its own
+        // "iter" if < 0) with 'seed' (its own if < 0); false if it can't
+        // be read, leaving the session as it was
+        bool update(const std::string& filename, int iter = -1, int64_t seed = -1) {
+            pipeline::plant next;
+            if(!pipeline::load(filename, next)) return false;
+            if(seed >= 0) next.rules.setSeed(seed);
+            update(next, (iter < 0) ? next.iter : iter);
+            return true;
+        }
+        const pipeline::plant& plant() const { return p; }
+        const turtle::segments& segments() const { return segs; }
+        // half-extent of the voxel volume, as pipeline::scale
+        int scale() const { return d; }
+    };
+}
+
+#define INCREMENTAL_HPP
+#endif
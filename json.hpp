@@ -21,13 +21,27 @@
 namespace json {
     // parse JSON InputFile
     rapidjson::Document doc;
-    void setInputFilename(const std::string& infilename) {
+    // parse a specification held in memory; false if it is not valid JSON
+    bool setInputString(const std::string& json) {
+        // parse JSON into rapidJSON::Document
+        doc.Parse(json.c_str());
+        return !doc.HasParseError();
+    }
+    // false if the file cannot be read or is not valid JSON
+    bool setInputFilename(const std::string& infilename) {
         std::ifstream input(infilename);
+        if(!input) {
+            std::cout << "(json) could not open " << infilename << "\n";
+            return false;
+        }
         // read file into std::string
         std::string json((std::istreambuf_iterator<char>(input)),
                         std::istreambuf_iterator<char>());
-        // parse JSON into rapidJSON::Document
-        doc.Parse(json.c_str());
+        if(!setInputString(json)) {
+            std::cout << "(json) could not parse " << infilename << "\n";
+            return false;
+        }
+        return true;
     }
     // get iter
     int getIterations() {
@@ -47,7 +61,8 @@ namespace json {
                 char c = p.GetString()[0];
                 params.push_back(c);
             }
-            modules.push_back(std::make_shared<grammar::module>(letter,params));
+            uint16_t id = modules.size();
+            modules.push_back(std::make_shared<grammar::module>(letter,params,id));
         }
     }
     // get axiom
@@ -73,9 +88,24 @@ namespace json {
         }
         return axiom;
     }
+    // get the seed of stochastic rules, 0 if not given
+    uint64_t getSeed() {
+        if(!doc.HasMember("seed")) return 0;
+        return std::stoull(std::string(doc["seed"].GetString()));
+    }
     // get rewriting/production rules
     grammar::rewrites getRules() {
         grammar::rewrites rules;
+        rules.setSeed(getSeed());
+        // modules context matching skips over
+        if(doc.HasMember("ignore")) {
+            for(auto& e : doc["ignore"].GetArray()) {
+                char letter = e.GetString()[0];
+                for(auto& m : grammar::modules) {
+                    if(m->getLetter() == letter) rules.ignore(m->getId());
+                }
+            }
+        }
         const rapidjson::Value& ra = doc["rules"];
         for(auto& r : ra.GetArray()) {
             char letter = r["symbol"].GetString()[0];
@@ -113,7 +143,29 @@ namespace json {
                 }
                 blueprints.push_back(grammar::blueprint(mP,evals));
             }
-            rules.push_back(grammar::production(mP,conditions,blueprints));
+            // context-sensitive rules name their neighbours & parameters
+            grammar::context contexts[2];
+            const char* sides[2] = {"left", "right"};
+            for(int side = 0; side < 2; ++side) {
+                if(!r.HasMember(sides[side])) continue;
+                const rapidjson::Value& cv = r[sides[side]];
+                char cLetter = cv["symbol"].GetString()[0];
+                for(auto& m : grammar::modules) {
+                    if(m->getLetter() == cLetter) {
+                        contexts[side].m = m; break;
+                    }
+                }
+                for(auto& p : cv["parameters"].GetArray())
+                    contexts[side].names.push_back(p.GetString()[0]);
+            }
+            // stochastic rules carry a selection weight
+            double probability = -1;
+            if(r.HasMember("probability"))
+                probability = std::stod(std::string(r["probability"].GetString()));
+            // compiles conditions & blueprint expressions, once per rule,
+            // and files the rule in the per-letter dispatch table
+            rules.push_back(grammar::production(mP,conditions,blueprints,probability,
+                contexts[0],contexts[1]));
         }
         return rules;
     }
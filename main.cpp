@@ -5,7 +5,9 @@
 #include "include/glm/gtx/transform.hpp"
 #include "include/glm/gtc/matrix_transform.hpp"
 
+#include <climits>
 #include <cmath>
+#include <fcntl.h>
 #include <iostream>
 #include <vector>
 #include <string>
@@ -16,6 +18,14 @@
 #include "vec3.hpp"
 #include "turtle.hpp"
 #include "sampler.hpp"
+#include "parallel.hpp"
+#include "mesher.hpp"
+#include "gpu.hpp"
+#include "pipeline.hpp"
+#include "stats.hpp"
+#include "codegen.hpp"
+#include "reload.hpp"
+#include "watch.hpp"
 
 // opengl utility
 #include "shader.hpp"
@@ -28,6 +38,109 @@ float cameraDistance = 6.0;
 void processInput(GLFWwindow*);
 
 int main(int argc, char * argv[]) {
+    // --stream: interpret the derived word as it is generated, without
+    // ever holding it in memory
+    // --memo: derive repeated subtrees once, and interpret shared fragments
+    // --segments: draw the turtle's segments as instanced cylinders,
+    // skipping voxelization
+    // --greedy: draw the voxels' greedy-meshed surface instead of cubes
+    // --smooth: draw the density's marching-cubes isosurface instead of cubes
+    // --obj <file>: also export the greedy or smooth surface as OBJ
+    // --headless: no window; derive, voxelize & mesh every input, writing
+    // <stem>.obj files (greedy, or --smooth) to --out <dir>, plus --raw
+    // density grids and --binary words & segments (see binary.hpp).
+    // Inputs are the remaining arguments (default input.json), with
+    // --iter <n>, --res <voxels> and --seed <n> (of stochastic rules)
+    // overrides.
+    // --quiet / --verbose: per-iteration output - none, or the whole word
+    // as well as the default summary line; --dump <file> sends the words
+    // to 'file' instead of stdout
+    // --stats <file>: time the stages, count rule hits, word lengths &
+    // bytes, and write them as JSON to 'file' ("-" for stdout) at the end
+    // --codegen <file>: compile the first input's rules to a C++ kernel
+    // (see codegen.hpp) in 'file', and exit
+    // With a window, the input and the shaders are watched: edits to the
+    // input are re-derived in the background (see reload.hpp) and swapped
+    // in when done; edited shaders are recompiled.
+    bool drawSegments = false, drawGreedy = false;
+    bool headless = false;
+    std::string objFile, statsFile, codegenFile;
+    pipeline::batch b;
+    // argv[a] as a whole number in [lo, hi]; false, reported, if it isn't one
+    auto number = [&](int a, long long& v, long long lo, long long hi) {
+        try {
+            size_t used;
+            v = std::stoll(argv[a], &used);
+            if((argv[a][used] == '\0') && (v >= lo) && (v <= hi)) return true;
+        }
+        catch(const std::exception&) {}
+        std::cout << "bad value for " << argv[a-1] << ": " << argv[a] << "\n";
+        return false;
+    };
+    for(int a = 1; a < argc; ++a) {
+        std::string arg = argv[a];
+        bool more = a+1 < argc;
+        if(arg == "--stream") b.derivation = pipeline::mode::stream;
+        else if(arg == "--memo") b.derivation = pipeline::mode::memo;
+        else if(arg == "--segments") drawSegments = true;
+        else if(arg == "--greedy") drawGreedy = true;
+        else if(arg == "--smooth") b.smooth = true;
+        else if(arg == "--headless") headless = true;
+        else if(arg == "--raw") b.raw = true;
+        else if(arg == "--binary") b.binary = true;
+        else if(arg == "--quiet") b.log.level = pipeline::verbosity::quiet;
+        else if(arg == "--verbose") b.log.level = pipeline::verbosity::words;
+        else if((arg == "--dump") && more) {
+            b.log.level = pipeline::verbosity::words;
+            b.log.fd = open(argv[++a], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if(b.log.fd < 0) {
+                std::cout << "could not open " << argv[a] << "\n";
+                return -1;
+            }
+        }
+        else if((arg == "--obj") && more) objFile = argv[++a];
+        else if((arg == "--stats") && more) statsFile = argv[++a];
+        else if((arg == "--codegen") && more) codegenFile = argv[++a];
+        else if((arg == "--out") && more) b.outDir = argv[++a];
+        else if((arg == "--iter") && more) {
+            long long v;
+            if(!number(++a, v, 0, INT_MAX)) return -1;
+            b.iter = v;
+        }
+        else if((arg == "--res") && more) {
+            long long v;
+            if(!number(++a, v, 1, INT_MAX)) return -1;
+            b.res = v;
+        }
+        else if((arg == "--seed") && more) {
+            long long v;
+            if(!number(++a, v, 0, LLONG_MAX)) return -1;
+            b.seed = v;
+        }
+        else b.inputs.push_back(arg);
+    }
+    if(b.inputs.empty()) b.inputs.push_back("input.json");
+    stats::enabled = !statsFile.empty();
+    auto writeStats = [&statsFile]() {
+        if(stats::enabled && !stats::writeReport(statsFile))
+            std::cout << "could not write " << statsFile << "\n";
+    };
+    if(!codegenFile.empty()) {
+        pipeline::plant p;
+        if(!pipeline::load(b.inputs[0], p)) return 1;
+        if(b.seed >= 0) p.rules.setSeed(b.seed);
+        if(!codegen::write(p.rules, b.inputs[0], codegenFile)) return 1;
+        std::cout << b.inputs[0] << ": " << p.rules.size() << " rules -> "
+                  << codegenFile << "\n";
+        return 0;
+    }
+    if(headless) {
+        int failures = pipeline::run(b);
+        writeStats();
+        return (failures == 0) ? 0 : 1;
+    }
+    bool drawSmooth = b.smooth;
+
     glfwInit();
     glfwWindowHint(GLFW_CLIENT_API, GLFW_OPENGL_ES_API);
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 2);
@@ -50,119 +163,75 @@ int main(int argc, char * argv[]) {
     glViewport(0,0,width,height);
     glEnable(GL_DEPTH_TEST);
 
-    // set parsing filename
-    json::setInputFilename("input.json");
     // L-system spec.
-    //  set modules
-    json::setModules(grammar::modules);
-    //  get axiom
-    grammar::word axiom = json::getAxiom();
-    //  get iterations
-    int iter = json::getIterations();
-    //  get rewriting rules
-    grammar::rewrites rules = json::getRules();
+    pipeline::plant plant;
+    if(!pipeline::load(b.inputs[0], plant)) {
+        glfwTerminate();
+        return -1;
+    }
+    int iter = (b.iter < 0) ? plant.iter : b.iter;
+    if(b.seed >= 0) plant.rules.setSeed(b.seed);
 
     std::cout << "tortuga will do " << iter << " applications\n";
 
     // get 'num'-th production
-    std::cout << "axiom:    " << grammar::wordToString(axiom) << "\n";
-    for(int i = 1; i <= iter; ++i) {
-        grammar::apply(axiom,rules);
-        std::cout << "(i = " << i << ") = " << grammar::wordToString(axiom) << "\n";
-    }
-
-    // turtle interpretation spec.
-    std::vector<std::pair<vec3,vec3>> moves = turtle::interpret(axiom);
-    float fD = 0;
-    vec3 fV = vec3(0,0,0);
-    for(auto& p : moves) {
-        //std::cout << p.first << " --> " << p.second << "\n";
-        float d1 = sqrt(dot(p.first,p.first));
-        if(d1>fD) { fV = p.first; fD = d1; }
-        float d2 = sqrt(dot(p.second,p.second));
-        if(d2>fD) { fV = p.second; fD = d2; }
-    }
-    int d = ceil(fD);
+    std::cout << "axiom:    " << grammar::wordToString(plant.axiom) << "\n";
+    parallel::pool threads;
+    turtle::segments segs;
+    pipeline::derive(plant, iter, b.derivation, threads, segs, b.log);
+    int d = pipeline::scale(segs);
     std::cout << "scale = " << d << "\n";
 
     // line rasterization (3D)
-    int voxelResX = 32;
-    int voxelResY = 32;
-    int voxelResZ = 32;
-    sampler::setContext(voxelResX,voxelResY,voxelResZ,-d,d,-d,d,0,2*d);
-    //for(auto& p : moves) {
-    //    sampler::sampleLine(p.first,p.second);
-    //}
-    //std::vector<std::pair<vec3,vec3>> myLines;
-    //myLines.push_back(std::make_pair(vec3(0,0,0),vec3(0,0,4)));
-    sampler::sampleLines(moves);
-    //sampler::sampleLines(myLines);
+    int voxelResX = b.res;
+    if(!drawSegments) {
+        pipeline::voxelize(segs, d, voxelResX);
+    }
 
     // source, compile, & link shaders into program
-    GLuint vertexShader = glsl::compileShader(GL_VERTEX_SHADER, "shaders/vertex.glsl");
-    GLuint fragmentShader = glsl::compileShader(GL_FRAGMENT_SHADER, "shaders/frag.glsl");
+    std::string vertexFile = "shaders/voxel_vertex.glsl";
+    std::string fragmentFile = "shaders/frag.glsl";
+    if(drawSegments) {
+        vertexFile = "shaders/segment_vertex.glsl";
+        fragmentFile = "shaders/segment_frag.glsl";
+    }
+    else if(drawGreedy || drawSmooth) {
+        vertexFile = "shaders/mesh_vertex.glsl";
+        fragmentFile = "shaders/mesh_frag.glsl";
+    }
+    GLuint vertexShader = glsl::compileShader(GL_VERTEX_SHADER, vertexFile);
+    GLuint fragmentShader = glsl::compileShader(GL_FRAGMENT_SHADER, fragmentFile);
     //GLuint vertexShader = glsl::compileShader(GL_VERTEX_SHADER, "shaders/rt_vertex.glsl");
     //GLuint fragmentShader = glsl::compileShader(GL_FRAGMENT_SHADER, "shaders/rt_frag.glsl");
     GLuint program = glsl::linkShaders(vertexShader, fragmentShader);
 
-    // setup vertex data (simple cube)
-    float cube_vertices[] = {
-        // front
-        -0.5, -0.5,  0.5,
-         0.5, -0.5,  0.5,
-         0.5,  0.5,  0.5,
-        -0.5,  0.5,  0.5,
-        // back
-        -0.5, -0.5, -0.5,
-         0.5, -0.5, -0.5,
-         0.5,  0.5, -0.5,
-        -0.5,  0.5, -0.5
-    };
-    float vertices[] = {
-        // T BL
-        -1.0f, -1.0f, 0.0f,
-        1.0f, -1.0f, 0.0f,
-        -1.0f, 1.0f, 0.0f,
-        // T TR
-        1.0f, 1.0f, 0.0f,
-        -1.0f, 1.0f, 0.0f,
-        1.0f, -1.0f, 0.0f
-    };
-    unsigned short cube_elements[] = {
-		// front
-		0, 1, 2,
-		2, 3, 0,
-		// right
-		1, 5, 6,
-		6, 2, 1,
-		// back
-		7, 6, 5,
-		5, 4, 7,
-		// left
-		4, 0, 3,
-		3, 7, 4,
-		// bottom
-		4, 5, 1,
-		1, 0, 4,
-		// top
-		3, 2, 6,
-		6, 7, 3
-	};
-    // vertex buffer 
-    GLuint vbo;
-    glGenBuffers(1, &vbo);
-    glBindBuffer(GL_ARRAY_BUFFER, vbo);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(cube_vertices), cube_vertices, GL_STATIC_DRAW);
-    //glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
-    // index buffer
-    GLuint ibo;
-    glGenBuffers(1, &ibo);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(cube_elements), cube_elements, GL_STATIC_DRAW);
-    // attribute location
-    GLuint vPositionLoc = glGetAttribLocation(program, "vPosition");
-    glVertexAttribPointer(vPositionLoc, 3, GL_FLOAT, GL_FALSE, 3*sizeof(float), (void*)0);
-    glEnableVertexAttribArray(vPositionLoc);
+    // segment, mesh or voxel buffers, uploaded once - the mesh is only
+    // rebuilt when the grid is resampled
+    bool instanced = gpu::loadInstancing();
+    gpu::segmentMesh segmentMesh;
+    gpu::voxelMesh voxelMesh;
+    gpu::meshBuffer meshBuffer;
+    if(drawSegments) {
+        if(!instanced)
+            std::cout << "(GPU) no instancing, drawing segments as lines\n";
+        stats::scope timer("gpu upload");
+        segmentMesh.upload(segs);
+    }
+    else if(drawGreedy || drawSmooth) {
+        mesher::mesh surface = pipeline::mesh(drawSmooth, threads);
+        std::cout << (drawSmooth ? "smooth" : "greedy") << " mesh: "
+                  << surface.triangles() << " triangles\n";
+        if(!objFile.empty() && !mesher::writeObj(surface, objFile))
+            std::cout << "(mesher) could not write " << objFile << "\n";
+        stats::scope timer("gpu upload");
+        meshBuffer.upload(surface);
+    }
+    else {
+        if(!instanced)
+            std::cout << "(GPU) no instancing, drawing voxels as one merged mesh\n";
+        stats::scope timer("gpu upload");
+        voxelMesh.upload(gpu::voxelOffsets(sampler::img, 0.5f));
+    }
     glUseProgram(program);
 
     // get uniform locations
@@ -170,6 +239,18 @@ int main(int argc, char * argv[]) {
     GLuint viewLoc = glGetUniformLocation(program, "view");
     GLuint projectionLoc = glGetUniformLocation(program, "projection");
 
+    // hot reload: the worker re-derives the input while frames keep
+    // drawing the current buffers, and meshes or lists voxels as drawn
+    watch::watcher watcher;
+    watcher.add(b.inputs[0]);
+    watcher.add(vertexFile);
+    watcher.add(fragmentFile);
+    reload::worker worker(b.inputs[0], b.iter, b.seed, voxelResX, [&](reload::model& m) {
+        if(drawSegments) return;
+        if(drawGreedy || drawSmooth) m.surface = pipeline::mesh(drawSmooth, threads);
+        else m.offsets = gpu::voxelOffsets(sampler::img, 0.5f);
+    });
+
     // initialize our matrices
     glm::mat4 model = glm::mat4(1.0f);
     model = glm::scale(model, glm::vec3(2.0f/d));
@@ -186,6 +267,55 @@ int main(int argc, char * argv[]) {
     while(!glfwWindowShouldClose(window)) {
         processInput(window);
 
+        bool shadersChanged = false;
+        for(const std::string& path : watcher.changed()) {
+            if(path == b.inputs[0]) worker.request();
+            else shadersChanged = true;
+        }
+        if(shadersChanged) {
+            // relink, keeping the current program if either shader fails
+            GLuint vs = glsl::compileShader(GL_VERTEX_SHADER, vertexFile);
+            GLuint fs = glsl::compileShader(GL_FRAGMENT_SHADER, fragmentFile);
+            GLuint next = (vs && fs) ? glsl::linkShaders(vs, fs) : 0;
+            if(vs) glDeleteShader(vs);
+            if(fs) glDeleteShader(fs);
+            if(next) {
+                glDeleteProgram(program);
+                program = next;
+                glUseProgram(program);
+                modelLoc = glGetUniformLocation(program, "model");
+                viewLoc = glGetUniformLocation(program, "view");
+                projectionLoc = glGetUniformLocation(program, "projection");
+                glUniformMatrix4fv(projectionLoc, 1, GL_FALSE, &projection[0][0]);
+                std::cout << "(reload) shaders relinked\n";
+            }
+        }
+        if(std::unique_ptr<reload::model> m = worker.take()) {
+            // upload into fresh buffers, then swap them in and free the old
+            stats::scope timer("gpu upload");
+            if(drawSegments) {
+                gpu::segmentMesh next;
+                next.upload(m->segs);
+                std::swap(segmentMesh, next);
+                next.release();
+            }
+            else if(drawGreedy || drawSmooth) {
+                gpu::meshBuffer next;
+                next.upload(m->surface);
+                std::swap(meshBuffer, next);
+                next.release();
+            }
+            else {
+                gpu::voxelMesh next;
+                next.upload(m->offsets);
+                std::swap(voxelMesh, next);
+                next.release();
+            }
+            d = m->scale;
+            model = glm::scale(glm::mat4(1.0f), glm::vec3(2.0f/d));
+            std::cout << "(reload) " << m->segs.size() << " segments swapped in\n";
+        }
+
         // clear drawing buffers
         glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
@@ -197,28 +327,27 @@ int main(int argc, char * argv[]) {
         view = glm::lookAt(glm::vec3(vX,vY,vZ), target, up);
         glUniformMatrix4fv(viewLoc, 1, GL_FALSE, &view[0][0]);
 
-        //// worse possible way - iterate over EVERY voxel, filled or not
-        for(int i = 0; i < sampler::img.size(); ++i) {
-        for(int j = 0; j < sampler::img[0].size(); ++j) {
-        for(int k = 0; k < sampler::img[0][0].size(); ++k) {
-            if(sampler::img[i][j][k] > 0.5f) {
-                float x = (float)i-(float)sampler::width/2.0f;//sampler::width*(sampler::wXF-sampler::wX0)+sampler::wX0;
-                float y = (float)j-(float)sampler::height/2.0f;///sampler::height*(sampler::wYF-sampler::wY0)+sampler::wY0;
-                float z = (float)k;///sampler::depth*(sampler::wZF-sampler::wZ0)+sampler::wZ0;
-                //std::cout << "(" << x << "," << y << "," << z << ")\n";
-                glm::mat4 tModel = glm::translate(model, glm::vec3(x,y,z));
-                glUniformMatrix4fv(modelLoc, 1, GL_FALSE, &tModel[0][0]);
-                glDrawElements(GL_TRIANGLES, 36, GL_UNSIGNED_SHORT, nullptr);
-            }
+        if(drawSegments) {
+            // world -> voxel-view scale, so both modes frame the tree alike
+            glm::mat4 sModel = glm::scale(model, glm::vec3(voxelResX/(2.0f*d)));
+            glUniformMatrix4fv(modelLoc, 1, GL_FALSE, &sModel[0][0]);
+            segmentMesh.draw(program);
         }
+        else if(drawGreedy || drawSmooth) {
+            glUniformMatrix4fv(modelLoc, 1, GL_FALSE, &model[0][0]);
+            meshBuffer.draw(program);
         }
+        else {
+            // every filled voxel in one instanced draw
+            glUniformMatrix4fv(modelLoc, 1, GL_FALSE, &model[0][0]);
+            voxelMesh.draw(program);
         }
-        glDrawArrays(GL_TRIANGLES, 0, 6);
         glfwSwapBuffers(window);
         glfwPollEvents();
     }
 
     glfwTerminate();
+    writeStats();
 }
 
 void processInput(GLFWwindow* window) {
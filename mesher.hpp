@@ -0,0 +1,341 @@
+// mesher.hpp
+// ----------
+// Surface extraction from sampled voxel grids, into indexed triangle meshes
+
+#ifndef MESHER_HPP
+
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "sampler.hpp"
+#include "parallel.hpp"
+
+namespace mesher {
+    // indexed triangle mesh: positions & normals as xyz triples
+    struct mesh {
+        std::vector<float> positions;
+        std::vector<float> normals;
+        std::vector<uint32_t> indices;
+        size_t vertices() const {
+            return positions.size()/3;
+        }
+        size_t triangles() const {
+            return indices.size()/3;
+        }
+        void clear() {
+            positions.clear(); normals.clear(); indices.clear();
+        }
+    };
+
+    // greedy mesh of the surface of the voxels above 'threshold': only faces
+    // between filled and empty cells are emitted, and coplanar faces with
+    // the same orientation are merged greedily into rectangles. Voxel
+    // (i,j,k) is the unit cube centred on (i - width/2, j - height/2, k),
+    // as the voxel view draws it.
+    template<typename T>
+    mesh greedy(const sampler::grid<T>& g, T threshold) {
+        mesh m;
+        const int dims[3] = {g.getWidth(), g.getHeight(), g.getDepth()};
+        const float shift[3] = {-dims[0]/2.0f - 0.5f, -dims[1]/2.0f - 0.5f, -0.5f};
+        auto filled = [&](int x[3]) {
+            if((x[0] < 0)||(x[1] < 0)||(x[2] < 0)) return false;
+            if((x[0] >= dims[0])||(x[1] >= dims[1])||(x[2] >= dims[2])) return false;
+            return g.at(x[0],x[1],x[2]) > threshold;
+        };
+        std::vector<int> mask;
+        // sweep planes along each axis d, with u & v spanning the plane
+        for(int d = 0; d < 3; ++d) {
+            int u = (d+1)%3, v = (d+2)%3;
+            mask.assign(dims[u]*dims[v], 0);
+            int x[3] = {0,0,0};
+            for(x[d] = -1; x[d] < dims[d]; ++x[d]) {
+                // +1: face towards +d (filled below, empty above), -1: towards -d
+                int n = 0;
+                for(x[v] = 0; x[v] < dims[v]; ++x[v]) {
+                    for(x[u] = 0; x[u] < dims[u]; ++x[u], ++n) {
+                        int y[3] = {x[0],x[1],x[2]};
+                        ++y[d];
+                        bool a = filled(x), b = filled(y);
+                        mask[n] = (a == b) ? 0 : (a ? 1 : -1);
+                    }
+                }
+                // merge runs along u, then extend them along v
+                n = 0;
+                for(int j = 0; j < dims[v]; ++j) {
+                    for(int i = 0; i < dims[u]; ) {
+                        int face = mask[n];
+                        if(face == 0) {
+                            ++i; ++n; continue;
+                        }
+                        int w = 1;
+                        while((i+w < dims[u])&&(mask[n+w] == face)) ++w;
+                        int h = 1;
+                        for(; j+h < dims[v]; ++h) {
+                            bool row = true;
+                            for(int k = 0; k < w; ++k) {
+                                if(mask[n+k+h*dims[u]] != face) {
+                                    row = false; break;
+                                }
+                            }
+                            if(!row) break;
+                        }
+                        // emit the quad, on the plane between x[d] & x[d]+1
+                        float o[3];
+                        o[d] = x[d]+1 + shift[d];
+                        o[u] = i + shift[u];
+                        o[v] = j + shift[v];
+                        float du[3] = {0,0,0}, dv[3] = {0,0,0}, nrm[3] = {0,0,0};
+                        du[u] = w; dv[v] = h; nrm[d] = face;
+                        uint32_t base = m.vertices();
+                        for(int c = 0; c < 4; ++c) {
+                            float a = (c == 1 || c == 2), b = (c >= 2);
+                            for(int e = 0; e < 3; ++e) {
+                                m.positions.push_back(o[e] + a*du[e] + b*dv[e]);
+                                m.normals.push_back(nrm[e]);
+                            }
+                        }
+                        // counter-clockwise seen from the face's outside
+                        if(face > 0) m.indices.insert(m.indices.end(),
+                            {base, base+1, base+2, base, base+2, base+3});
+                        else m.indices.insert(m.indices.end(),
+                            {base, base+2, base+1, base, base+3, base+2});
+                        // clear the merged faces
+                        for(int l = 0; l < h; ++l)
+                            for(int k = 0; k < w; ++k)
+                                mask[n+k+l*dims[u]] = 0;
+                        i += w; n += w;
+                    }
+                }
+            }
+        }
+        return m;
+    }
+
+    // marching cubes tables, built once from the cube's topology rather than
+    // written out: corner c sits at (c&1, c>>1&1, c>>2&1), and edge e joins
+    // corners edgeCorners[e]. For every configuration (bit c set when corner
+    // c is inside), tris[config] lists its triangles as edge triples.
+    const int edgeCorners[12][2] = {
+        {0,1},{2,3},{4,5},{6,7},    // along x
+        {0,2},{1,3},{4,6},{5,7},    // along y
+        {0,4},{1,5},{2,6},{3,7}     // along z
+    };
+    struct cubeCases {
+        std::array<std::vector<int>,256> tris;
+        cubeCases() {
+            int edgeOf[8][8];
+            for(int e = 0; e < 12; ++e) {
+                edgeOf[edgeCorners[e][0]][edgeCorners[e][1]] = e;
+                edgeOf[edgeCorners[e][1]][edgeCorners[e][0]] = e;
+            }
+            // faces, corners counter-clockwise as seen from outside the cube
+            int faces[6][4];
+            for(int a = 0; a < 3; ++a) {
+                int u = (a+1)%3, v = (a+2)%3;
+                for(int side = 0; side < 2; ++side) {
+                    int uv[4][2] = {{0,0},{1,0},{1,1},{0,1}};
+                    for(int c = 0; c < 4; ++c) {
+                        int q = side ? c : 3-c;
+                        faces[2*a+side][c] = (side << a) | (uv[q][0] << u) | (uv[q][1] << v);
+                    }
+                }
+            }
+            // faces touching each edge, as a bit mask
+            int faceMask[12] = {0};
+            for(int f = 0; f < 6; ++f)
+            for(int c = 0; c < 4; ++c)
+                faceMask[edgeOf[faces[f][c]][faces[f][(c+1)%4]]] |= 1 << f;
+            for(int config = 0; config < 256; ++config) {
+                auto inside = [config](int c) { return (config >> c) & 1; };
+                // walking each face's boundary, join the crossing where it
+                // enters the inside to the crossing where it leaves - a
+                // face's inside corners are always cut off separately, so
+                // neighbouring cubes agree on their shared faces
+                int next[12];
+                for(int e = 0; e < 12; ++e) next[e] = -1;
+                for(const auto& f : faces) {
+                    for(int c = 0; c < 4; ++c) {
+                        int p = f[c], q = f[(c+1)%4];
+                        if(inside(p) || !inside(q)) continue;
+                        int enter = edgeOf[p][q];
+                        int d = (c+1)%4;
+                        while(inside(f[(d+1)%4])) d = (d+1)%4;
+                        next[enter] = edgeOf[f[d]][f[(d+1)%4]];
+                    }
+                }
+                // each closed loop of edges is one polygon, fanned into triangles
+                bool used[12] = {false};
+                for(int e = 0; e < 12; ++e) {
+                    if((next[e] < 0)||used[e]) continue;
+                    std::vector<int> loop;
+                    for(int x = e; !used[x]; x = next[x]) {
+                        used[x] = true;
+                        loop.push_back(x);
+                    }
+                    // fan from a vertex whose diagonals stay off the cube's
+                    // faces, or the neighbouring cube would emit the same edge
+                    size_t n = loop.size(), r = 0;
+                    for(; r < n; ++r) {
+                        bool flat = false;
+                        for(size_t t = 2; t+1 < n; ++t)
+                            flat |= (faceMask[loop[r]] & faceMask[loop[(r+t)%n]]) != 0;
+                        if(!flat) break;
+                    }
+                    if(r == n) r = 0;
+                    for(size_t t = 1; t+1 < n; ++t) {
+                        tris[config].insert(tris[config].end(),
+                            {loop[r], loop[(r+t)%n], loop[(r+t+1)%n]});
+                    }
+                }
+            }
+        }
+    };
+    const cubeCases& marchingCases() {
+        static const cubeCases cases;
+        return cases;
+    }
+
+    // marching cubes isosurface of 'g' at 'iso', with outward normals from
+    // the density gradient, in the voxel view's frame (voxel (i,j,k) at
+    // (i - width/2, j - height/2, k)). The grid is padded with empty cells,
+    // so the surface is closed. Slabs along x are meshed in parallel on
+    // 'threads', if given; vertices are welded along shared cube edges,
+    // within slabs and across their boundaries.
+    mesh marchingCubes(const sampler::grid<float>& g, float iso,
+        parallel::pool* threads = nullptr)
+    {
+        const int W = g.getWidth(), H = g.getHeight(), D = g.getDepth();
+        const cubeCases& cases = marchingCases();
+        auto value = [&](int i, int j, int k) {
+            if((i < 0)||(j < 0)||(k < 0)||(i >= W)||(j >= H)||(k >= D)) return 0.0f;
+            return g.at(i,j,k);
+        };
+        // cube edge id, unique over the padded grid
+        auto edgeId = [&](int i, int j, int k, int axis) {
+            return (((uint64_t)axis*(W+2) + (i+1))*(H+2) + (j+1))*(D+2) + (k+1);
+        };
+        // cells i in [-1, W) are cut into slabs of whole x layers
+        struct slab {
+            int i0, i1;
+            mesh m;
+            std::vector<uint64_t> edges;
+        };
+        size_t count = threads ? std::min<size_t>(W+1, 4*threads->size()) : 1;
+        std::vector<slab> slabs(count);
+        for(size_t s = 0; s < count; ++s) {
+            slabs[s].i0 = -1 + (int)((W+1)*s/count);
+            slabs[s].i1 = -1 + (int)((W+1)*(s+1)/count);
+        }
+        auto march = [&](size_t s) {
+            slab& sl = slabs[s];
+            std::unordered_map<uint64_t,uint32_t> welded;
+            for(int i = sl.i0; i < sl.i1; ++i)
+            for(int j = -1; j < H; ++j)
+            for(int k = -1; k < D; ++k) {
+                float v[8];
+                int config = 0;
+                for(int c = 0; c < 8; ++c) {
+                    v[c] = value(i+(c&1), j+(c>>1&1), k+(c>>2&1));
+                    if(v[c] > iso) config |= 1 << c;
+                }
+                const std::vector<int>& tris = cases.tris[config];
+                for(int e : tris) {
+                    int a = edgeCorners[e][0], b = edgeCorners[e][1];
+                    int axis = (e < 4) ? 0 : (e < 8) ? 1 : 2;
+                    int ai = i+(a&1), aj = j+(a>>1&1), ak = k+(a>>2&1);
+                    uint64_t id = edgeId(ai, aj, ak, axis);
+                    auto it = welded.find(id);
+                    if(it != welded.end()) {
+                        sl.m.indices.push_back(it->second);
+                        continue;
+                    }
+                    // new vertex, interpolated along the edge
+                    float t = (iso - v[a])/(v[b] - v[a]);
+                    int bi = i+(b&1), bj = j+(b>>1&1), bk = k+(b>>2&1);
+                    float p[3] = {ai + t*(bi-ai), aj + t*(bj-aj), ak + t*(bk-ak)};
+                    // normal: the negated central-difference gradient
+                    float ga[3] = {value(ai+1,aj,ak)-value(ai-1,aj,ak),
+                        value(ai,aj+1,ak)-value(ai,aj-1,ak), value(ai,aj,ak+1)-value(ai,aj,ak-1)};
+                    float gb[3] = {value(bi+1,bj,bk)-value(bi-1,bj,bk),
+                        value(bi,bj+1,bk)-value(bi,bj-1,bk), value(bi,bj,bk+1)-value(bi,bj,bk-1)};
+                    float n[3], len = 0;
+                    for(int x = 0; x < 3; ++x) {
+                        n[x] = -(ga[x] + t*(gb[x]-ga[x]));
+                        len += n[x]*n[x];
+                    }
+                    len = (len > 0) ? std::sqrt(len) : 1.0f;
+                    sl.m.positions.insert(sl.m.positions.end(),
+                        {p[0] - W/2.0f, p[1] - H/2.0f, p[2]});
+                    sl.m.normals.insert(sl.m.normals.end(), {n[0]/len, n[1]/len, n[2]/len});
+                    uint32_t index = sl.edges.size();
+                    sl.edges.push_back(id);
+                    welded.emplace(id, index);
+                    sl.m.indices.push_back(index);
+                }
+            }
+        };
+        if(threads) threads->run(count, march);
+        else march(0);
+        // stitch slabs in order: vertices on the plane between two slabs
+        // (edges along y & z at x = i0) are shared with the previous slab
+        mesh m;
+        std::unordered_map<uint64_t,uint32_t> plane, nextPlane;
+        for(const slab& sl : slabs) {
+            std::vector<uint32_t> remap(sl.edges.size());
+            nextPlane.clear();
+            for(size_t v = 0; v < sl.edges.size(); ++v) {
+                uint64_t id = sl.edges[v];
+                // decode x & axis of the edge id
+                uint64_t rest = id / ((uint64_t)(H+2)*(D+2));
+                int x = (int)(rest % (W+2)) - 1, axis = (int)(rest / (W+2));
+                auto it = (axis != 0 && x == sl.i0) ? plane.find(id) : plane.end();
+                if(it != plane.end()) {
+                    remap[v] = it->second;
+                }
+                else {
+                    remap[v] = m.vertices();
+                    m.positions.insert(m.positions.end(), sl.m.positions.begin()+3*v,
+                        sl.m.positions.begin()+3*v+3);
+                    m.normals.insert(m.normals.end(), sl.m.normals.begin()+3*v,
+                        sl.m.normals.begin()+3*v+3);
+                }
+                if(axis != 0 && x == sl.i1) nextPlane.emplace(id, remap[v]);
+            }
+            for(uint32_t index : sl.m.indices)
+                m.indices.push_back(remap[index]);
+            plane.swap(nextPlane);
+        }
+        return m;
+    }
+
+    // write 'm' as a Wavefront OBJ file; false if it cannot be written
+    bool writeObj(const mesh& m, const std::string& filename) {
+        std::ofstream out(filename);
+        if(!out) return false;
+        for(size_t v = 0; v < m.vertices(); ++v) {
+            out << "v " << m.positions[3*v] << " " << m.positions[3*v+1] << " "
+                << m.positions[3*v+2] << "\n";
+        }
+        for(size_t v = 0; v < m.vertices(); ++v) {
+            out << "vn " << m.normals[3*v] << " " << m.normals[3*v+1] << " "
+                << m.normals[3*v+2] << "\n";
+        }
+        for(size_t t = 0; t < m.triangles(); ++t) {
+            out << "f";
+            for(int c = 0; c < 3; ++c) {
+                uint32_t v = m.indices[3*t+c] + 1;
+                out << " " << v << "//" << v;
+            }
+            out << "\n";
+        }
+        return (bool)out;
+    }
+}
+
+#define MESHER_HPP
+#endif
@@ -0,0 +1,85 @@
+// parallel.hpp
+// ------------
+// Minimal thread pool, for data-parallel passes over words
+
+#ifndef PARALLEL_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace parallel {
+    // fixed set of worker threads; run(count, task) calls task(i) for every
+    // i in [0,count) across the workers and the calling thread, and returns
+    // once all are done. run is not reentrant, and one thread drives a pool.
+    class pool {
+        std::vector<std::thread> workers;
+        std::mutex lock;
+        std::condition_variable wake, idle;
+        const std::function<void(size_t)>* task = nullptr;
+        size_t count = 0;
+        std::atomic<size_t> next{0};
+        // workers yet to finish the current job, and job generation
+        size_t busy = 0;
+        unsigned long job = 0;
+        bool stop = false;
+        void work(size_t n, const std::function<void(size_t)>& f) {
+            for(size_t i; (i = next++) < n; ) f(i);
+        }
+        void loop() {
+            unsigned long seen = 0;
+            std::unique_lock<std::mutex> l(lock);
+            while(true) {
+                wake.wait(l, [&]{ return stop || (job != seen); });
+                if(stop) return;
+                seen = job;
+                const std::function<void(size_t)>& f = *task;
+                size_t n = count;
+                l.unlock();
+                work(n, f);
+                l.lock();
+                if(--busy == 0) idle.notify_all();
+            }
+        }
+    public:
+        pool(size_t threads = std::thread::hardware_concurrency()) {
+            for(size_t i = 1; i < threads; ++i)
+                workers.emplace_back(&pool::loop, this);
+        }
+        ~pool() {
+            {
+                std::lock_guard<std::mutex> l(lock);
+                stop = true;
+            }
+            wake.notify_all();
+            for(auto& w : workers) w.join();
+        }
+        pool(const pool&) = delete;
+        pool& operator=(const pool&) = delete;
+        // threads taking part in run, including the caller
+        size_t size() const {
+            return workers.size()+1;
+        }
+        void run(size_t n, const std::function<void(size_t)>& f) {
+            if(workers.empty()) {
+                for(size_t i = 0; i < n; ++i) f(i);
+                return;
+            }
+            std::unique_lock<std::mutex> l(lock);
+            task = &f; count = n; next = 0;
+            busy = workers.size(); ++job;
+            l.unlock();
+            wake.notify_all();
+            work(n, f);
+            l.lock();
+            idle.wait(l, [&]{ return busy == 0; });
+        }
+    };
+}
+
+#define PARALLEL_HPP
+#endif
@@ -25,120 +25,197 @@ static bool is_number(const std::string& s) {
 }
 
 namespace parse {
-    // parse lex'd conditional expression (assumes postfix)
-    bool evaluateConditional(std::string expression, std::vector<char> params, std::vector<double> vals) {
-        auto iss = std::istringstream{expression};
-        std::string str;
-        std::vector<double> tStack;
-        while (iss >> str) {
-            // check for a given parameter
-            if((str.length() == 1)&&isalpha(str[0])) {
-                for(int i = 0; i < params.size(); ++i) {
-                    if(params[i] == str[0]) {
-                        tStack.push_back(vals[i]);
-                        break;
+    // opcodes of a compiled postfix expression
+    enum class op : unsigned char {
+        param, constant,            // push a parameter slot / a constant
+        add, sub, mul, div,         // arithmetic
+        lt, le, gt, ge              // conditionals
+    };
+    struct instruction {
+        op code;
+        unsigned short arg;         // parameter slot or constant index
+    };
+    // compiled postfix expression - parameter names are resolved to slots
+    // and numbers are parsed once, so evaluation is a flat walk over the
+    // opcodes with a fixed-size stack
+    class expression {
+        std::vector<instruction> code;
+        std::vector<double> constants;
+        bool conditional = false;
+        bool valid = true;
+        void push(op code, unsigned short arg = 0) {
+            this->code.push_back(instruction{code, arg});
+        }
+        void pushConstant(double val) {
+            push(op::constant, constants.size());
+            constants.push_back(val);
+        }
+    public:
+        static const int maxStack = 16;
+        expression() {}
+        // compile 'str' against the parameter names 'params'; conditionals
+        // end at their first comparison, arithmetic ignores comparisons
+        expression(const std::string& str, const std::vector<char>& params,
+            bool isConditional = false)
+            : conditional(isConditional)
+        {
+            auto iss = std::istringstream{str};
+            std::string tok;
+            int depth = 0, maxDepth = 0;
+            bool compared = false;
+            while (iss >> tok) {
+                int pops = 0;
+                // check for a given parameter
+                if((tok.length() == 1)&&isalpha(tok[0])) {
+                    int slot = -1;
+                    for(int i = 0; i < (int)params.size(); ++i) {
+                        if(params[i] == tok[0]) {
+                            slot = i;
+                            break;
+                        }
                     }
+                    if(slot >= 0) push(op::param, slot);
+                    else pushConstant(0.0);
+                    pops = -1;
                 }
-                // catch something
-            }
-            // check for a number
-            else if(is_number(str)) {
-                tStack.push_back(std::stod(str));
-            }
-            // operations
-            else if(str == "+") {
-                double x = tStack.back(); tStack.pop_back();
-                double y = tStack.back(); tStack.pop_back();
-                tStack.push_back(x+y);
-            }
-            else if(str == "-") {
-                double y = tStack.back(); tStack.pop_back();
-                double x = tStack.back(); tStack.pop_back();
-                tStack.push_back(x-y);
-            }
-            else if(str == "/") {
-                double y = tStack.back(); tStack.pop_back();
-                double x = tStack.back(); tStack.pop_back();
-                tStack.push_back(x/y);
-            }
-            else if(str == "*") {
-                double x = tStack.back(); tStack.pop_back();
-                double y = tStack.back(); tStack.pop_back();
-                tStack.push_back(x*y);
-            }
-            // conditionals
-            else if(str == "<=") {
-                double y = tStack.back(); tStack.pop_back();
-                double x = tStack.back(); tStack.pop_back();
-                return (x <= y);
+                // check for a number
+                else if(is_number(tok)) {
+                    pushConstant(std::stod(tok));
+                    pops = -1;
+                }
+                // operations
+                else if(tok == "+") { push(op::add); pops = 1; }
+                else if(tok == "-") { push(op::sub); pops = 1; }
+                else if(tok == "/") { push(op::div); pops = 1; }
+                else if(tok == "*") { push(op::mul); pops = 1; }
+                // conditionals
+                else if(conditional && (tok == "<=")) { push(op::le); compared = true; }
+                else if(conditional && (tok == ">=")) { push(op::ge); compared = true; }
+                else if(conditional && (tok == ">")) { push(op::gt); compared = true; }
+                else if(conditional && (tok == "<")) { push(op::lt); compared = true; }
+                if(compared) pops = 1;
+                // track stack depth, so evaluation never checks bounds
+                if((pops > 0)&&(depth < 2)) { valid = false; break; }
+                depth -= pops;
+                if(depth > maxDepth) maxDepth = depth;
+                if(compared) break;
+            }
+            if(maxDepth > maxStack) valid = false;
+            if(!valid) {
+                std::cout << "(parse) malformed expression \"" << str << "\"\n";
+                code.clear(); constants.clear();
+                pushConstant(0.0);
+            }
+            else if(conditional && !compared) {
+                std::cout << "unexpected conditional\n";
+                valid = false;
+            }
+            else if(code.empty()) {
+                pushConstant(0.0);
             }
-            else if(str == ">=") {
-                double y = tStack.back(); tStack.pop_back();
-                double x = tStack.back(); tStack.pop_back();
-                return (x >= y);
+        }
+        const std::vector<instruction>& getCode() const { return code; }
+        const std::vector<double>& getConstants() const { return constants; }
+        bool isValid() const { return valid; }
+        // re-point parameter slots: slot i reads vals[slots[i]], or 0 if < 0
+        void remap(const std::vector<int>& slots) {
+            for(auto& in : code) {
+                if(in.code != op::param) continue;
+                if(slots[in.arg] >= 0) {
+                    in.arg = slots[in.arg];
+                }
+                else {
+                    in.code = op::constant;
+                    in.arg = constants.size();
+                    constants.push_back(0.0);
+                }
             }
-            else if(str == ">") {
-                double y = tStack.back(); tStack.pop_back();
-                double x = tStack.back(); tStack.pop_back();
-                return (x > y);
+        }
+        double evaluate(const double* vals) const {
+            double stack[maxStack];
+            int top = 0;
+            for(const auto& in : code) {
+                switch(in.code) {
+                case op::param:    stack[top++] = vals[in.arg]; break;
+                case op::constant: stack[top++] = constants[in.arg]; break;
+                case op::add: --top; stack[top-1] = stack[top] + stack[top-1]; break;
+                case op::sub: --top; stack[top-1] = stack[top-1] - stack[top]; break;
+                case op::div: --top; stack[top-1] = stack[top-1] / stack[top]; break;
+                case op::mul: --top; stack[top-1] = stack[top] * stack[top-1]; break;
+                case op::lt:  --top; stack[top-1] = (stack[top-1] < stack[top]); break;
+                case op::le:  --top; stack[top-1] = (stack[top-1] <= stack[top]); break;
+                case op::gt:  --top; stack[top-1] = (stack[top-1] > stack[top]); break;
+                case op::ge:  --top; stack[top-1] = (stack[top-1] >= stack[top]); break;
+                }
             }
-            else if(str == "<") {
-                double y = tStack.back(); tStack.pop_back();
-                double x = tStack.back(); tStack.pop_back();
-                return (x < y);
+            return stack[top-1];
+        }
+        bool test(const double* vals) const {
+            if(!valid) return false;
+            return evaluate(vals) != 0.0;
+        }
+        // evaluate over 'n' <= maxLanes lanes at once: lane l reads slot s
+        // from in[s*maxLanes + l] and writes out[l]. Each opcode is a loop
+        // over all maxLanes lanes - a fixed trip count with no remainder,
+        // which GCC & Clang vectorize at -O2 - so lanes n and up of 'in'
+        // must hold values (e.g. zeros) too; only out[0, n) is written.
+        static const int maxLanes = 64;
+        void evaluate(const double* in, int n, double* out) const {
+            double stack[maxStack][maxLanes];
+            int top = 0;
+            for(const auto& i : code) {
+                if(i.code == op::param) {
+                    const double* p = in + i.arg*maxLanes;
+                    double* t = stack[top++];
+                    for(int l = 0; l < maxLanes; ++l) t[l] = p[l];
+                    continue;
+                }
+                if(i.code == op::constant) {
+                    double c = constants[i.arg];
+                    double* t = stack[top++];
+                    for(int l = 0; l < maxLanes; ++l) t[l] = c;
+                    continue;
+                }
+                --top;
+                double* a = stack[top-1];
+                const double* b = stack[top];
+                switch(i.code) {
+                case op::add: for(int l = 0; l < maxLanes; ++l) a[l] = b[l] + a[l]; break;
+                case op::sub: for(int l = 0; l < maxLanes; ++l) a[l] = a[l] - b[l]; break;
+                case op::div: for(int l = 0; l < maxLanes; ++l) a[l] = a[l] / b[l]; break;
+                case op::mul: for(int l = 0; l < maxLanes; ++l) a[l] = b[l] * a[l]; break;
+                case op::lt:  for(int l = 0; l < maxLanes; ++l) a[l] = (a[l] < b[l]); break;
+                case op::le:  for(int l = 0; l < maxLanes; ++l) a[l] = (a[l] <= b[l]); break;
+                case op::gt:  for(int l = 0; l < maxLanes; ++l) a[l] = (a[l] > b[l]); break;
+                case op::ge:  for(int l = 0; l < maxLanes; ++l) a[l] = (a[l] >= b[l]); break;
+                default: break;
+                }
             }
+            for(int l = 0; l < n; ++l) out[l] = stack[top-1][l];
+        }
+        // test over lanes: pass[l] is cleared where lane l fails
+        void test(const double* in, int n, bool* pass) const {
+            if(!valid) {
+                for(int l = 0; l < n; ++l) pass[l] = false;
+                return;
+            }
+            double out[maxLanes];
+            evaluate(in, n, out);
+            for(int l = 0; l < n; ++l) pass[l] = pass[l] && (out[l] != 0.0);
         }
-        // catch something
-        std::cout << "unexpected conditional\n";
-        return false;
+    };
+
+    // parse lex'd conditional expression (assumes postfix)
+    bool evaluateConditional(const std::string& expression,
+        const std::vector<char>& params, const std::vector<double>& vals)
+    {
+        return parse::expression(expression, params, true).test(vals.data());
     }
 
-    double evaluateArithmetic(std::string expression, std::vector<char> params,
-        std::vector<double> vals)
+    double evaluateArithmetic(const std::string& expression,
+        const std::vector<char>& params, const std::vector<double>& vals)
     {
-        //std::cout << "evaluting: \"" << expression << "\"\n";
-        auto iss = std::istringstream{expression};
-        std::string str;
-        std::vector<double> tStack;
-        while (iss >> str) {
-            // check for a given parameter
-            if((str.length() == 1)&&isalpha(str[0])) {
-                for(int i = 0; i < params.size(); ++i) {
-                    if(params[i] == str[0]) {
-                        tStack.push_back(vals[i]);
-                        break;
-                    }
-                }
-                // catch something
-            }
-            // check for a number
-            else if(is_number(str)) {
-                tStack.push_back(std::stod(str));
-            }
-            // operations
-            else if(str == "+") {
-                double x = tStack.back(); tStack.pop_back();
-                double y = tStack.back(); tStack.pop_back();
-                tStack.push_back(x+y);
-            }
-            else if(str == "-") {
-                double y = tStack.back(); tStack.pop_back();
-                double x = tStack.back(); tStack.pop_back();
-                tStack.push_back(x-y);
-            }
-            else if(str == "/") {
-                double y = tStack.back(); tStack.pop_back();
-                double x = tStack.back(); tStack.pop_back();
-                tStack.push_back(x/y);
-            }
-            else if(str == "*") {
-                double x = tStack.back(); tStack.pop_back();
-                double y = tStack.back(); tStack.pop_back();
-                tStack.push_back(x*y);
-            }
-            // catch something
-        }
-        return tStack.back();
+        return parse::expression(expression, params).evaluate(vals.data());
     }
 }
 
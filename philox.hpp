@@ -0,0 +1,45 @@
+// philox.hpp
+// ----------
+// Philox4x32-10 counter-based random numbers (Salmon et al., "Parallel
+// random numbers: as easy as 1, 2, 3"). A draw is a pure function of a key
+// and a counter, so there is no state to share between threads or to
+// replay in order: the same (key, counter) always gives the same numbers.
+
+#ifndef PHILOX_HPP
+
+#include <array>
+#include <cstdint>
+
+namespace philox {
+    typedef std::array<uint32_t,4> block;
+
+    inline void mulhilo(uint32_t a, uint32_t b, uint32_t& hi, uint32_t& lo) {
+        uint64_t p = (uint64_t)a * b;
+        hi = (uint32_t)(p >> 32);
+        lo = (uint32_t)p;
+    }
+    // ten rounds over counter 'c' with key (k0, k1)
+    inline block generate(block c, uint32_t k0, uint32_t k1) {
+        for(int round = 0; round < 10; ++round) {
+            if(round > 0) {
+                k0 += 0x9E3779B9; k1 += 0xBB67AE85;
+            }
+            uint32_t hi0, lo0, hi1, lo1;
+            mulhilo(0xD2511F53, c[0], hi0, lo0);
+            mulhilo(0xCD9E8D57, c[2], hi1, lo1);
+            c = {hi1 ^ c[1] ^ k0, lo1, hi0 ^ c[3] ^ k1, lo0};
+        }
+        return c;
+    }
+    // uniform double in [0,1), from 53 bits of the block drawn for
+    // counter (a, b) under key 'seed'
+    inline double uniform(uint64_t seed, uint32_t a, uint64_t b) {
+        block x = generate({a, (uint32_t)b, (uint32_t)(b >> 32), 0},
+            (uint32_t)seed, (uint32_t)(seed >> 32));
+        uint64_t bits = ((uint64_t)(x[0] >> 5) << 26) | (x[1] >> 6);
+        return bits * (1.0 / 9007199254740992.0);
+    }
+}
+
+#define PHILOX_HPP
+#endif
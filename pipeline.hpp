@@ -0,0 +1,240 @@
+// pipeline.hpp
+// ------------
+// The grammar -> turtle -> sampler pipeline, without any GL: load a JSON
+// specification, derive it, interpret it into segments and voxelize them.
+// Shared by the viewer and the headless batch mode.
+
+#ifndef PIPELINE_HPP
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "json.hpp"
+#include "grammar.hpp"
+#include "turtle.hpp"
+#include "sampler.hpp"
+#include "parallel.hpp"
+#include "mesher.hpp"
+#include "binary.hpp"
+#include "dump.hpp"
+#include "stats.hpp"
+
+namespace pipeline {
+    // an L-system specification, as read from JSON
+    struct plant {
+        grammar::word axiom;
+        grammar::rewrites rules;
+        int iter = 0;
+    };
+
+    // how to derive: flat (in parallel), streamed, or over the memo DAG
+    enum class mode { flat, stream, memo };
+
+    // what a flat derivation reports per iteration: nothing, a summary
+    // line (size & time), or the summary and the whole word, dumped to 'fd'
+    enum class verbosity { quiet, summary, words };
+    struct logging {
+        verbosity level = verbosity::summary;
+        int fd = STDOUT_FILENO;
+    };
+
+    // fill 'p' from the parsed JSON document. The module table is reset
+    // first, so inputs can be loaded one after another.
+    void fill(plant& p) {
+        stats::scope timer("load");
+        grammar::modules.clear();
+        json::setModules(grammar::modules);
+        p.axiom = json::getAxiom();
+        p.iter = json::getIterations();
+        p.rules = json::getRules();
+    }
+    // load 'filename' into 'p'; false if it cannot be read
+    bool load(const std::string& filename, plant& p) {
+        if(!json::setInputFilename(filename)) return false;
+        fill(p);
+        return true;
+    }
+    // load the specification 'text' into 'p'; false if it is not JSON
+    bool loadString(const std::string& text, plant& p) {
+        if(!json::setInputString(text)) {
+            std::cout << "(json) could not parse specification\n";
+            return false;
+        }
+        fill(p);
+        return true;
+    }
+
+    // derive 'p' for 'iter' steps and interpret the result into 'segs',
+    // reporting as 'log' says. The final word is kept in 'word', if given -
+    // except when streamed, as it never exists.
+    void derive(const plant& p, int iter, mode m, parallel::pool& threads,
+        turtle::segments& segs, const logging& log = logging(),
+        grammar::packedWord* word = nullptr)
+    {
+        stats::scope timer("derive");
+        segs.clear();
+        if((m == mode::memo) && p.rules.isStochastic()) {
+            std::cout << "(pipeline) stochastic rules can't share fragments, deriving flat\n";
+            m = mode::flat;
+        }
+        if((m != mode::flat) && p.rules.hasContext()) {
+            std::cout << "(pipeline) context-sensitive rules need whole words, deriving flat\n";
+            m = mode::flat;
+        }
+        if(m == mode::stream) {
+            // turtle interpretation spec., straight from the generator
+            grammar::generator generator(grammar::pack(p.axiom), p.rules, iter);
+            turtle::interpret(generator, segs);
+        }
+        else if(m == mode::memo) {
+            // turtle interpretation spec., over the fragment DAG
+            grammar::expansion expansion(p.rules);
+            uint32_t root = expansion.expand(grammar::pack(p.axiom), iter);
+            std::cout << "derived " << expansion.length(root) << " modules from "
+                      << expansion.size() << " fragments\n";
+            stats::scope interpretTimer("interpret");
+            turtle::interpret(expansion, root, segs);
+            if(word) *word = expansion.flatten(root);
+        }
+        else {
+            grammar::derivation derivation(p.axiom, &threads);
+            for(int i = 1; i <= iter; ++i) {
+                auto t0 = std::chrono::steady_clock::now();
+                derivation.step(p.rules);
+                auto t1 = std::chrono::steady_clock::now();
+                const grammar::packedWord& w = derivation.current();
+                if(stats::enabled) {
+                    stats::time("derive iteration",
+                        std::chrono::duration<double>(t1-t0).count());
+                    stats::sample("word length", w.size());
+                    stats::peak("word bytes", derivation.bytes());
+                }
+                if(log.level == verbosity::quiet) continue;
+                std::cout << "(i = " << i << ") " << w.size() << " modules, "
+                          << w.pool.size() << " values, " << w.bytes() << " bytes, "
+                          << std::chrono::duration<double,std::milli>(t1-t0).count()
+                          << " ms\n";
+                if(log.level == verbosity::words) {
+                    // keep the dump in order with std::cout, if they share a file
+                    std::cout.flush();
+                    dump::writer out(log.fd);
+                    out.put("(i = "); out.put((size_t)i); out.put(") = ");
+                    dump::word(out, w);
+                    out.put('\n');
+                }
+            }
+            // turtle interpretation spec.
+            stats::scope interpretTimer("interpret");
+            turtle::interpret(derivation.current(), segs);
+            if(word) *word = derivation.current();
+        }
+    }
+
+    // half-extent of the voxel volume: the farthest segment endpoint from
+    // the origin, rounded up
+    int scale(const turtle::segments& segs) {
+        float fD = 0;
+        for(size_t i = 0; i < segs.size(); ++i) {
+            vec3 r0 = segs.getStart(i), rf = segs.getEnd(i);
+            fD = std::max(fD, std::sqrt(dot(r0,r0)));
+            fD = std::max(fD, std::sqrt(dot(rf,rf)));
+        }
+        return (int)std::ceil(fD);
+    }
+
+    // rasterize 'segs' into sampler::img, res^3 voxels over [-d,d]^2 x [0,2d]
+    void voxelize(const turtle::segments& segs, int d, int res) {
+        stats::scope timer("voxelize");
+        sampler::setContext(res,res,res,-d,d,-d,d,0,2*d);
+        sampler::sampleSegments(segs.start.data(), segs.end.data(), segs.size());
+        stats::count("segments", segs.size());
+        stats::peak("segment bytes", sizeof(float)*(segs.start.capacity()
+            + segs.end.capacity() + segs.radius.capacity() + segs.depth.capacity()));
+        stats::peak("voxel grid bytes", sampler::img.bytes());
+    }
+
+    // surface of sampler::img: marching cubes if 'smooth', else greedy
+    mesher::mesh mesh(bool smooth, parallel::pool& threads) {
+        stats::scope timer("mesh");
+        mesher::mesh surface = smooth
+            ? mesher::marchingCubes(sampler::img, 0.5f, &threads)
+            : mesher::greedy(sampler::img, 0.5f);
+        stats::count("triangles", surface.triangles());
+        return surface;
+    }
+
+    // write a density grid as raw float32, in grid index order; false if
+    // it cannot be written
+    bool writeRaw(const sampler::grid<float>& g, const std::string& filename) {
+        FILE* out = std::fopen(filename.c_str(), "wb");
+        if(out == nullptr) return false;
+        bool ok = std::fwrite(g.data(), sizeof(float), g.size(), out) == g.size();
+        return (std::fclose(out) == 0) && ok;
+    }
+
+    // headless batch settings
+    struct batch {
+        std::vector<std::string> inputs;
+        std::string outDir = ".";
+        int iter = -1;          // < 0: the input's own "iter"
+        int64_t seed = -1;      // < 0: the input's own "seed"
+        int res = 32;
+        mode derivation = mode::flat;
+        bool smooth = false;    // marching cubes, else greedy
+        bool raw = false;       // also write the density grid
+        bool binary = false;    // also write the word & segments, see binary.hpp
+        logging log;
+    };
+
+    // run every input of 'b' through the pipeline, writing
+    // '<outDir>/<stem>.obj' (and '<stem>.raw', '<stem>.word', '<stem>.segs');
+    // returns the failure count
+    int run(const batch& b) {
+        parallel::pool threads;
+        turtle::segments segs;
+        grammar::packedWord word;
+        bool keepWord = b.binary && (b.derivation != mode::stream);
+        stats::scope timer("run");
+        int failures = 0;
+        for(const std::string& input : b.inputs) {
+            plant p;
+            if(!load(input, p)) {
+                ++failures;
+                continue;
+            }
+            int iter = (b.iter < 0) ? p.iter : b.iter;
+            if(b.seed >= 0) p.rules.setSeed(b.seed);
+            word.clear();
+            derive(p, iter, b.derivation, threads, segs, b.log, keepWord ? &word : nullptr);
+            int d = std::max(scale(segs), 1);
+            voxelize(segs, d, b.res);
+            mesher::mesh surface = mesh(b.smooth, threads);
+
+            // output names from the input's stem
+            size_t slash = input.find_last_of("/\\");
+            std::string stem = input.substr((slash == std::string::npos) ? 0 : slash+1);
+            stem = stem.substr(0, stem.find_last_of('.'));
+            std::string base = b.outDir + "/" + stem;
+            bool ok = mesher::writeObj(surface, base + ".obj");
+            if(ok && b.raw) ok = writeRaw(sampler::img, base + ".raw");
+            if(ok && keepWord) ok = binary::write(word, base + ".word");
+            if(ok && b.binary) ok = binary::write(segs, base + ".segs");
+            if(!ok) {
+                std::cout << "(pipeline) could not write " << base << "\n";
+                ++failures;
+                continue;
+            }
+            std::cout << input << ": " << iter << " iterations, " << segs.size()
+                      << " segments, " << surface.triangles() << " triangles -> "
+                      << base << "\n";
+        }
+        return failures;
+    }
+}
+
+#define PIPELINE_HPP
+#endif
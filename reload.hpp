@@ -0,0 +1,109 @@
+// reload.hpp
+// ----------
+// Background reloading of a specification: a worker thread re-derives and
+// re-voxelizes it through an incremental::session whenever asked, while
+// the caller goes on with the model it has. Finished models are handed
+// over whole, for the render thread to upload and swap in at once.
+
+#ifndef RELOAD_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "incremental.hpp"
+#include "mesher.hpp"
+#include "parallel.hpp"
+#include "turtle.hpp"
+
+namespace reload {
+    // what the render thread needs to draw a reloaded specification
+    struct model {
+        turtle::segments segs;
+        mesher::mesh surface;
+        std::vector<float> offsets;
+        int scale = 1;
+    };
+
+    // rebuilds 'filename' on its own thread: derives it 'iter' times (its
+    // own "iter" if < 0) with 'seed' (its own if < 0) into sampler::img at
+    // 'res', then calls 'finish' on the worker thread to fill in the rest
+    // of the model (e.g. meshing). sampler::img and grammar::modules belong
+    // to the worker while it lives.
+    class worker {
+        parallel::pool threads;
+        incremental::session s;
+        std::string filename;
+        int iter;
+        int64_t seed;
+        std::function<void(model&)> finish;
+        std::mutex lock;
+        std::condition_variable wake;
+        bool requested = false, stopping = false;
+        std::unique_ptr<model> done;
+        std::atomic<bool> ready{false};
+        std::thread thread;
+        void loop() {
+            std::unique_lock<std::mutex> l(lock);
+            while(true) {
+                wake.wait(l, [&]{ return stopping || requested; });
+                if(stopping) return;
+                requested = false;
+                // requests made while building coalesce into one more build
+                l.unlock();
+                std::unique_ptr<model> m;
+                if(s.update(filename, iter, seed)) {
+                    m.reset(new model);
+                    m->segs = s.segments();
+                    m->scale = std::max(s.scale(), 1);
+                    if(finish) finish(*m);
+                }
+                l.lock();
+                if(m) {
+                    done = std::move(m);
+                    ready = true;
+                }
+            }
+        }
+    public:
+        worker(const std::string& filename, int iter, int64_t seed, int res,
+            std::function<void(model&)> finish = nullptr)
+            : s(threads, res), filename(filename), iter(iter), seed(seed),
+              finish(finish), thread(&worker::loop, this)
+            {}
+        worker(const worker&) = delete;
+        worker& operator=(const worker&) = delete;
+        ~worker() {
+            {
+                std::lock_guard<std::mutex> l(lock);
+                stopping = true;
+            }
+            wake.notify_one();
+            thread.join();
+        }
+        // rebuild from the file as it is now
+        void request() {
+            {
+                std::lock_guard<std::mutex> l(lock);
+                requested = true;
+            }
+            wake.notify_one();
+        }
+        // the newest finished model, or null; cheap enough to call per frame
+        std::unique_ptr<model> take() {
+            if(!ready) return nullptr;
+            std::lock_guard<std::mutex> l(lock);
+            ready = false;
+            return std::move(done);
+        }
+    };
+}
+
+#define RELOAD_HPP
+#endif
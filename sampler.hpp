@@ -4,6 +4,11 @@
 #include <memory>
 #include <utility>
 #include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <new>
+#include <unordered_map>
 
 static float max(float a, float b) {
     return (a<b)?b:a;
@@ -15,18 +20,167 @@ static float min(float a, float b) {
 #include "vec3.hpp"
 
 namespace sampler {
-    using vector1f = std::vector<float>;
-    using vector2f = std::vector<vector1f>;
-    using vector3f = std::vector<vector2f>;
-    vector3f img;
+    // dense voxel grid in one contiguous, 64-byte aligned allocation, with
+    // voxel (i,j,k) at index(i,j,k) = (i*height + j)*depth + k. T is the
+    // voxel type, e.g. uint8_t occupancy or float density.
+    template<typename T>
+    class grid {
+        T* voxels = nullptr;
+        int w = 0, h = 0, d = 0;
+        void allocate() {
+            voxels = static_cast<T*>(::operator new[](size()*sizeof(T),
+                std::align_val_t(alignment)));
+        }
+        void release() {
+            if(voxels) ::operator delete[](voxels, std::align_val_t(alignment));
+            voxels = nullptr;
+        }
+    public:
+        static const size_t alignment = 64;
+        grid() {}
+        grid(int width, int height, int depth, T fill = T())
+            : w(width), h(height), d(depth)
+        {
+            allocate();
+            std::fill(begin(), end(), fill);
+        }
+        grid(const grid& g)
+            : w(g.w), h(g.h), d(g.d)
+        {
+            allocate();
+            std::copy(g.begin(), g.end(), begin());
+        }
+        grid(grid&& g)
+            : voxels(g.voxels), w(g.w), h(g.h), d(g.d)
+        {
+            g.voxels = nullptr;
+            g.w = g.h = g.d = 0;
+        }
+        grid& operator=(grid g) {
+            std::swap(voxels, g.voxels);
+            std::swap(w, g.w); std::swap(h, g.h); std::swap(d, g.d);
+            return *this;
+        }
+        ~grid() {
+            release();
+        }
+        int getWidth() const { return w; }
+        int getHeight() const { return h; }
+        int getDepth() const { return d; }
+        size_t size() const { return (size_t)w*h*d; }
+        size_t bytes() const { return size()*sizeof(T); }
+        size_t index(int i, int j, int k) const {
+            return ((size_t)i*h + j)*d + k;
+        }
+        // inverse of index
+        void coords(size_t n, int& i, int& j, int& k) const {
+            k = n % d; n /= d;
+            j = n % h;
+            i = n / h;
+        }
+        T& at(int i, int j, int k) { return voxels[index(i,j,k)]; }
+        const T& at(int i, int j, int k) const { return voxels[index(i,j,k)]; }
+        T& operator[](size_t n) { return voxels[n]; }
+        const T& operator[](size_t n) const { return voxels[n]; }
+        T* data() { return voxels; }
+        const T* data() const { return voxels; }
+        T* begin() { return voxels; }
+        T* end() { return voxels + size(); }
+        const T* begin() const { return voxels; }
+        const T* end() const { return voxels + size(); }
+    };
+    // sparse voxel grid: the grid is cut into 8x8x8 bricks and only bricks
+    // that have been written are stored, found by a hash of their brick
+    // coordinates - memory follows the occupied surface, not the volume.
+    // Up to 2^21 voxels per axis.
+    template<typename T>
+    class sparseGrid {
+        static const int shift = 3, edge = 1 << shift, brickSize = edge*edge*edge;
+        int w = 0, h = 0, d = 0;
+        std::unordered_map<uint64_t,uint32_t> bricks;
+        // brick b's voxels at [b*brickSize, (b+1)*brickSize), and its key
+        std::vector<T> voxels;
+        std::vector<uint64_t> keys;
+        // last brick touched, as writes mostly stay within a brick
+        uint64_t lastKey = ~0ull;
+        uint32_t lastBrick = 0;
+        static uint64_t key(int i, int j, int k) {
+            return ((uint64_t)(i >> shift) << 42) | ((uint64_t)(j >> shift) << 21)
+                | (uint64_t)(k >> shift);
+        }
+        static int local(int i, int j, int k) {
+            return ((i & (edge-1))*edge + (j & (edge-1)))*edge + (k & (edge-1));
+        }
+    public:
+        sparseGrid() {}
+        sparseGrid(int width, int height, int depth)
+            : w(width), h(height), d(depth)
+            {}
+        int getWidth() const { return w; }
+        int getHeight() const { return h; }
+        int getDepth() const { return d; }
+        // voxel (i,j,k), storing its brick if absent
+        T& at(int i, int j, int k) {
+            uint64_t kk = key(i,j,k);
+            if(kk != lastKey) {
+                auto it = bricks.find(kk);
+                if(it == bricks.end()) {
+                    it = bricks.emplace(kk, (uint32_t)keys.size()).first;
+                    keys.push_back(kk);
+                    voxels.resize(voxels.size() + brickSize, T());
+                }
+                lastKey = kk;
+                lastBrick = it->second;
+            }
+            return voxels[(size_t)lastBrick*brickSize + local(i,j,k)];
+        }
+        // voxel (i,j,k), T() if its brick is absent
+        T get(int i, int j, int k) const {
+            auto it = bricks.find(key(i,j,k));
+            if(it == bricks.end()) return T();
+            return voxels[(size_t)it->second*brickSize + local(i,j,k)];
+        }
+        size_t brickCount() const {
+            return keys.size();
+        }
+        // approximate bytes held, hash table included
+        size_t bytes() const {
+            return voxels.capacity()*sizeof(T) + keys.capacity()*sizeof(uint64_t)
+                + bricks.size()*(sizeof(std::pair<uint64_t,uint32_t>) + 2*sizeof(void*))
+                + bricks.bucket_count()*sizeof(void*);
+        }
+        // visit(i, j, k, value) for every stored voxel that is not T()
+        template<typename Visitor>
+        void forEach(Visitor visit) const {
+            const uint64_t mask = (1ull << 21) - 1;
+            for(size_t b = 0; b < keys.size(); ++b) {
+                int bi = (keys[b] >> 42) << shift, bj = ((keys[b] >> 21) & mask) << shift,
+                    bk = (keys[b] & mask) << shift;
+                const T* brick = voxels.data() + b*brickSize;
+                for(int n = 0; n < brickSize; ++n) {
+                    if(brick[n] == T()) continue;
+                    visit(bi + n/(edge*edge), bj + (n/edge)%edge, bk + n%edge, brick[n]);
+                }
+            }
+        }
+    };
+
+    // record a sample in a voxel: densities count, occupancy is set
+    inline void accumulate(float& v) { v += 1.0f; }
+    inline void accumulate(uint8_t& v) { v = 1; }
+    inline void occupy(float& v) { v = 1.0f; }
+    inline void occupy(uint8_t& v) { v = 1; }
+
+    grid<float> img;
     // image dimensions
     int width = 0, height = 0, depth = 0;
     // world coordinates
     float wX0 = 0, wXF = 0;
     float wY0 = 0, wYF = 0;
     float wZ0 = 0, wZF = 0;
-    // set rasterization context
-    void setContext(int imageWidth, int imageHeight, int imageDepth,
+    // set rasterization bounds, for sampling into grids of one's own
+    // (e.g. a sparseGrid too large to allocate densely)
+    void setBounds(int imageWidth, int imageHeight, int imageDepth,
         float worldX0, float worldXF, 
         float worldY0, float worldYF, 
         float worldZ0, float worldZF)
@@ -35,9 +189,19 @@ namespace sampler {
         wX0 = worldX0; wXF = worldXF;
         wY0 = worldY0; wYF = worldYF;
         wZ0 = worldZ0; wZF = worldZF;
-        img = vector3f(width,vector2f(height,vector1f(depth,0)));
     }
-    void sampleLine(vec3 r0, vec3 rf) {
+    // set rasterization context
+    void setContext(int imageWidth, int imageHeight, int imageDepth,
+        float worldX0, float worldXF, 
+        float worldY0, float worldYF, 
+        float worldZ0, float worldZF)
+    {
+        setBounds(imageWidth, imageHeight, imageDepth,
+            worldX0, worldXF, worldY0, worldYF, worldZ0, worldZF);
+        img = grid<float>(width,height,depth);
+    }
+    template<typename G>
+    void sampleLine(G& g, vec3 r0, vec3 rf) {
         // transform world -> voxel
         rf = (rf-vec3(wX0,wY0,wZ0))/vec3(wXF-wX0,wYF-wY0,wZF-wZ0)*vec3(width,height,depth);
         r0 = (r0-vec3(wX0,wY0,wZ0))/vec3(wXF-wX0,wYF-wY0,wZF-wZ0)*vec3(width,height,depth);
@@ -53,61 +217,125 @@ namespace sampler {
             if((i<0)||(i>width-1)) break;
             if((j<0)||(j>height-1)) break;
             if((k<0)||(k>depth-1)) break;
-            img[i][j][k] = 1.0f;
+            occupy(g.at(i,j,k));
             //std::cout << "(sampler): " << "[" << i << "," << j << "," << k << "]\n";
             x += dx; y += dy; z += dz;
         }
     }
-    void sampleLines(std::vector<std::pair<vec3,vec3>> lines)
+    // voxel -> world space
+    inline float voxelX(int i) {
+        return (float)i/sampler::width*(sampler::wXF-sampler::wX0)+sampler::wX0;
+    }
+    inline float voxelY(int j) {
+        return (float)j/sampler::height*(sampler::wYF-sampler::wY0)+sampler::wY0;
+    }
+    inline float voxelZ(int k) {
+        return (float)k/sampler::depth*(sampler::wZF-sampler::wZ0)+sampler::wZ0;
+    }
+    // voxel indices [first, last] whose world coordinate along an axis may
+    // lie in [lo, hi], padded by a voxel either side
+    static void span(double lo, double hi, float w0, float wF, int n,
+        int& first, int& last)
     {
-        for(int i = 0; i < img.size(); ++i) {
-        for(int j = 0; j < img[0].size(); ++j) {
-        for(int k = 0; k < img[0][0].size(); ++k) {
-            // transform voxel -> world space
-            float x = (float)i/sampler::width*(sampler::wXF-sampler::wX0)+sampler::wX0;
-            float y = (float)j/sampler::height*(sampler::wYF-sampler::wY0)+sampler::wY0;
-            float z = (float)k/sampler::depth*(sampler::wZF-sampler::wZ0)+sampler::wZ0;
-            vec3 p(x,y,z);
-            // get distance to line segment - if less than d, draw that voxel
-            for(int li = 0; li < lines.size(); ++li) {
-                // get line distance
-                vec3 rf = lines[li].second; vec3 r0 = lines[li].first;
-                float ld = sqrt(dot(rf-r0,rf-r0));
-                float tH = dot(p-r0,rf-r0)/dot(rf-r0,rf-r0);
-                if((tH<0)||(tH>1)) continue;
-                vec3 pL = r0 + tH*(rf-r0);
-                float d = sqrt(dot(pL-p,pL-p));
-                //if(d <= ld/4.0f*(0.5+0.1*tH)) {
-                if(d <= 1.0f) {
-                    img[i][j][k] += 1.0f;
+        double a = (lo-w0)/(wF-w0)*n, b = (hi-w0)/(wF-w0)*n;
+        if(a > b) std::swap(a,b);
+        first = (int)std::max(0.0, std::floor(a)-1);
+        last = (int)std::min(n-1.0, std::ceil(b)+1);
+    }
+    // narrow [t0, t1] to where |a + t*b - c| <= r; false if empty
+    static bool clip(double a, double b, double c, double r, double& t0, double& t1) {
+        if(b == 0) return std::fabs(a-c) <= r;
+        double s0 = (c-r-a)/b, s1 = (c+r-a)/b;
+        if(s0 > s1) std::swap(s0,s1);
+        t0 = std::max(t0,s0); t1 = std::min(t1,s1);
+        return t0 <= t1;
+    }
+    // visit(i,j,k) for every voxel within distance 1 of the segment
+    // r0 -> rf. Only voxels near the segment are visited: it is clipped to
+    // each x slab to bound y, then to each xy column to bound z;
+    // candidates then get the exact distance test.
+    template<typename Visitor>
+    void coverSegment(vec3 r0, vec3 rf, Visitor visit) {
+        vec3 dr = rf-r0;
+        // zero-length (or non-finite) segments never pass the test
+        if(!(dot(dr,dr) > 0)||!std::isfinite(dot(dr,dr))) return;
+        // reach, with slack for rounding in the float test below
+        const double reach = 1.0 + 1e-3 + 1e-5*std::max({std::fabs(wX0),std::fabs(wXF),
+            std::fabs(wY0),std::fabs(wYF),std::fabs(wZ0),std::fabs(wZF)});
+        int i0, i1, j0, j1, k0, k1;
+        span(std::min(r0.x(),rf.x())-reach, std::max(r0.x(),rf.x())+reach,
+            wX0, wXF, width, i0, i1);
+        for(int i = i0; i <= i1; ++i) {
+            float x = voxelX(i);
+            double a0 = 0, a1 = 1;
+            if(!clip(r0.x(), dr.x(), x, reach, a0, a1)) continue;
+            double ya = r0.y()+a0*dr.y(), yb = r0.y()+a1*dr.y();
+            span(std::min(ya,yb)-reach, std::max(ya,yb)+reach, wY0, wYF, height, j0, j1);
+            for(int j = j0; j <= j1; ++j) {
+                float y = voxelY(j);
+                double b0 = a0, b1 = a1;
+                if(!clip(r0.y(), dr.y(), y, reach, b0, b1)) continue;
+                double za = r0.z()+b0*dr.z(), zb = r0.z()+b1*dr.z();
+                span(std::min(za,zb)-reach, std::max(za,zb)+reach, wZ0, wZF, depth, k0, k1);
+                for(int k = k0; k <= k1; ++k) {
+                    vec3 p(x,y,voxelZ(k));
+                    // get distance to line segment - if less than d, draw that voxel
+                    float tH = dot(p-r0,rf-r0)/dot(rf-r0,rf-r0);
+                    if((tH<0)||(tH>1)) continue;
+                    vec3 pL = r0 + tH*(rf-r0);
+                    float d = sqrt(dot(pL-p,pL-p));
+                    if(d <= 1.0f) {
+                        visit(i,j,k);
+                    }
                 }
             }
-        }}}
+        }
+    }
+    // add 1 to every voxel within distance 1 of the segment r0 -> rf
+    template<typename G>
+    void sampleSegment(G& g, vec3 r0, vec3 rf) {
+        coverSegment(r0, rf, [&g](int i, int j, int k) { accumulate(g.at(i,j,k)); });
     }
-    void sampleLinesC(std::vector<std::pair<vec3,vec3>> lines)
+    // take back a sampleSegment: densities are whole counts, so adding and
+    // removing segments in any order gives the same grid as sampling the
+    // final set afresh
+    void removeSegment(grid<float>& g, vec3 r0, vec3 rf) {
+        coverSegment(r0, rf, [&g](int i, int j, int k) { g.at(i,j,k) -= 1.0f; });
+    }
+    template<typename G>
+    void sampleLines(G& g, const std::vector<std::pair<vec3,vec3>>& lines)
     {
-        for(int i = 0; i < img.size(); ++i) {
-        for(int j = 0; j < img[0].size(); ++j) {
-        for(int k = 0; k < img[0][0].size(); ++k) {
-            // transform voxel -> world space
-            float x = (float)i/sampler::width*(sampler::wXF-sampler::wX0)+sampler::wX0;
-            float y = (float)j/sampler::height*(sampler::wYF-sampler::wY0)+sampler::wY0;
-            float z = (float)k/sampler::depth*(sampler::wZF-sampler::wZ0)+sampler::wZ0;
-            vec3 p(x,y,z);
-            // get distance to line segment - if less than d, draw that voxel
-            for(int li = 0; li < lines.size(); ++li) {
-                // get line distance
-                vec3 rf = lines[li].second; vec3 r0 = lines[li].first;
-                float ld = sqrt(dot(rf-r0,rf-r0));
-                float tH = dot(p-r0,rf-r0)/dot(rf-r0,rf-r0);
-                if((tH<0)||(tH>1)) continue;
-                vec3 pL = r0 + tH*(rf-r0);
-                float d = sqrt(dot(pL-p,pL-p));
-                if(d <= 1.0f) {
-                    img[i][j][k] += 1.0f;
-                }
-            }
-        }}}
+        for(const auto& l : lines)
+            sampleSegment(g, l.first, l.second);
+    }
+    // sample 'count' segments given as xyz triples, e.g. a turtle::segments
+    template<typename G>
+    void sampleSegments(G& g, const float* start, const float* end, size_t count)
+    {
+        for(size_t s = 0; s < count; ++s) {
+            sampleSegment(g, vec3(start[3*s],start[3*s+1],start[3*s+2]),
+                vec3(end[3*s],end[3*s+1],end[3*s+2]));
+        }
+    }
+
+    // the same, into sampler::img
+    void sampleLine(vec3 r0, vec3 rf) {
+        sampleLine(img, r0, rf);
+    }
+    void sampleSegment(vec3 r0, vec3 rf) {
+        sampleSegment(img, r0, rf);
+    }
+    void sampleLines(const std::vector<std::pair<vec3,vec3>>& lines)
+    {
+        sampleLines(img, lines);
+    }
+    void sampleLinesC(const std::vector<std::pair<vec3,vec3>>& lines)
+    {
+        sampleLines(img, lines);
+    }
+    void sampleSegments(const float* start, const float* end, size_t count)
+    {
+        sampleSegments(img, start, end, count);
     }
 }
 
@@ -0,0 +1,8 @@
+precision mediump float;
+varying vec3 vNorm;
+void main() 
+{
+    // ambient plus one directional light
+    float l = 0.35 + 0.65*max(dot(normalize(vNorm), normalize(vec3(0.5, 0.3, 0.8))), 0.0);
+    gl_FragColor = vec4(l*vec3(0.55, 0.35, 0.2), 1.0);
+}
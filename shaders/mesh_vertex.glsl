@@ -0,0 +1,11 @@
+attribute vec3 vPosition;
+attribute vec3 vNormal;
+varying vec3 vNorm;
+uniform mat4 model;
+uniform mat4 view;
+uniform mat4 projection;
+void main()
+{
+    vNorm = vNormal;
+    gl_Position = projection * view * model * vec4(vPosition,1.0);
+}
@@ -0,0 +1,10 @@
+precision mediump float;
+varying float vDepth;
+varying float vShade;
+void main()
+{
+    // bark at the trunk, greener towards the tips
+    float t = clamp(vDepth/8.0, 0.0, 1.0);
+    vec3 color = mix(vec3(0.45, 0.3, 0.15), vec3(0.3, 0.6, 0.2), t);
+    gl_FragColor = vec4(vShade*color, 1.0);
+}
@@ -0,0 +1,26 @@
+// unit cylinder: vPosition.xy on the unit circle, vPosition.z in [0,1]
+attribute vec3 vPosition;
+// per-instance segment
+attribute vec3 iStart;
+attribute vec3 iEnd;
+attribute float iRadius;
+attribute float iDepth;
+varying float vDepth;
+varying float vShade;
+uniform mat4 model;
+uniform mat4 view;
+uniform mat4 projection;
+void main()
+{
+    // orthonormal frame around the segment axis
+    vec3 axis = iEnd - iStart;
+    vec3 w = normalize(axis);
+    vec3 a = vec3(1.0, 0.0, 0.0);
+    if(abs(w.z) < 0.9) a = vec3(0.0, 0.0, 1.0);
+    vec3 u = normalize(cross(a, w));
+    vec3 v = cross(w, u);
+    vec3 p = iStart + axis*vPosition.z + iRadius*(u*vPosition.x + v*vPosition.y);
+    vDepth = iDepth;
+    vShade = 0.6 + 0.4*vPosition.x;
+    gl_Position = projection * view * model * vec4(p,1.0);
+}
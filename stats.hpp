@@ -0,0 +1,159 @@
+// stats.hpp
+// ---------
+// Run statistics: scoped timers, counters, per-iteration series, indexed
+// tallies and peak byte counts, reported as JSON at the end of a run.
+// Everything is off unless 'enabled' is set; then each call costs a
+// branch. Recording takes a lock, so parallel code should gather its
+// counts per chunk and record the merged result once.
+
+#ifndef STATS_HPP
+
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace stats {
+    bool enabled = false;
+
+    struct timing {
+        double seconds = 0;
+        size_t calls = 0;
+    };
+    struct registry {
+        std::mutex lock;
+        std::map<std::string,timing> timers;
+        std::map<std::string,size_t> counters;
+        std::map<std::string,std::vector<double>> series;
+        std::map<std::string,std::vector<size_t>> tallies;
+        std::map<std::string,size_t> peaks;
+    };
+    registry records;
+
+    void clear() {
+        std::lock_guard<std::mutex> guard(records.lock);
+        records.timers.clear();
+        records.counters.clear();
+        records.series.clear();
+        records.tallies.clear();
+        records.peaks.clear();
+    }
+
+    // time spent under 'name', summed over calls
+    void time(const std::string& name, double seconds) {
+        if(!enabled) return;
+        std::lock_guard<std::mutex> guard(records.lock);
+        timing& t = records.timers[name];
+        t.seconds += seconds;
+        t.calls += 1;
+    }
+    // times its own lifetime under 'name'
+    class scope {
+        const char* name;
+        bool on;
+        std::chrono::steady_clock::time_point t0;
+    public:
+        scope(const char* name) : name(name), on(enabled) {
+            if(on) t0 = std::chrono::steady_clock::now();
+        }
+        scope(const scope&) = delete;
+        scope& operator=(const scope&) = delete;
+        ~scope() {
+            if(!on) return;
+            auto t1 = std::chrono::steady_clock::now();
+            time(name, std::chrono::duration<double>(t1-t0).count());
+        }
+    };
+    // add 'n' to counter 'name'
+    void count(const std::string& name, size_t n = 1) {
+        if(!enabled) return;
+        std::lock_guard<std::mutex> guard(records.lock);
+        records.counters[name] += n;
+    }
+    // append 'v' to series 'name', e.g. once per iteration
+    void sample(const std::string& name, double v) {
+        if(!enabled) return;
+        std::lock_guard<std::mutex> guard(records.lock);
+        records.series[name].push_back(v);
+    }
+    // add 'hits' element-wise to tally 'name', e.g. hits per rule
+    void tally(const std::string& name, const std::vector<size_t>& hits) {
+        if(!enabled) return;
+        std::lock_guard<std::mutex> guard(records.lock);
+        std::vector<size_t>& t = records.tallies[name];
+        if(t.size() < hits.size()) t.resize(hits.size());
+        for(size_t i = 0; i < hits.size(); ++i) t[i] += hits[i];
+    }
+    // keep the largest byte count seen under 'name'
+    void peak(const std::string& name, size_t bytes) {
+        if(!enabled) return;
+        std::lock_guard<std::mutex> guard(records.lock);
+        size_t& p = records.peaks[name];
+        if(bytes > p) p = bytes;
+    }
+
+    // the records as a JSON object
+    std::string report() {
+        std::lock_guard<std::mutex> guard(records.lock);
+        std::ostringstream out;
+        out.precision(9);
+        auto quote = [](const std::string& s) { return "\"" + s + "\""; };
+        out << "{\n  \"timers\": {";
+        const char* sep = "\n";
+        for(const auto& t : records.timers) {
+            out << sep << "    " << quote(t.first) << ": {\"seconds\": "
+                << t.second.seconds << ", \"calls\": " << t.second.calls << "}";
+            sep = ",\n";
+        }
+        out << "\n  },\n  \"counters\": {";
+        sep = "\n";
+        for(const auto& c : records.counters) {
+            out << sep << "    " << quote(c.first) << ": " << c.second;
+            sep = ",\n";
+        }
+        out << "\n  },\n  \"series\": {";
+        sep = "\n";
+        for(const auto& s : records.series) {
+            out << sep << "    " << quote(s.first) << ": [";
+            for(size_t i = 0; i < s.second.size(); ++i)
+                out << (i ? ", " : "") << s.second[i];
+            out << "]";
+            sep = ",\n";
+        }
+        out << "\n  },\n  \"tallies\": {";
+        sep = "\n";
+        for(const auto& t : records.tallies) {
+            out << sep << "    " << quote(t.first) << ": [";
+            for(size_t i = 0; i < t.second.size(); ++i)
+                out << (i ? ", " : "") << t.second[i];
+            out << "]";
+            sep = ",\n";
+        }
+        out << "\n  },\n  \"peakBytes\": {";
+        sep = "\n";
+        for(const auto& p : records.peaks) {
+            out << sep << "    " << quote(p.first) << ": " << p.second;
+            sep = ",\n";
+        }
+        out << "\n  }\n}\n";
+        return out.str();
+    }
+    // write the report to 'filename', or stdout for "-"; false on failure
+    bool writeReport(const std::string& filename) {
+        std::string r = report();
+        if(filename == "-") {
+            std::fputs(r.c_str(), stdout);
+            return true;
+        }
+        FILE* out = std::fopen(filename.c_str(), "w");
+        if(out == nullptr) return false;
+        bool ok = std::fputs(r.c_str(), out) >= 0;
+        return (std::fclose(out) == 0) && ok;
+    }
+}
+
+#define STATS_HPP
+#endif
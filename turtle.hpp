@@ -12,6 +12,53 @@
 #include "grammar.hpp"
 
 namespace turtle {
+    // segment buffer - structure of arrays of turtle moves, laid out for
+    // direct upload as vertex attributes: start & end points (xyz triples),
+    // radius, and branching depth
+    struct segments {
+        std::vector<float> start;
+        std::vector<float> end;
+        std::vector<float> radius;
+        std::vector<float> depth;
+        size_t size() const {
+            return radius.size();
+        }
+        void clear() {
+            start.clear(); end.clear(); radius.clear(); depth.clear();
+        }
+        void swap(segments& s) {
+            start.swap(s.start); end.swap(s.end);
+            radius.swap(s.radius); depth.swap(s.depth);
+        }
+        void reserve(size_t n) {
+            start.reserve(3*n); end.reserve(3*n);
+            radius.reserve(n); depth.reserve(n);
+        }
+        void push(vec3 r0, vec3 rf, float r, float d) {
+            start.insert(start.end(), r0.data.begin(), r0.data.end());
+            end.insert(end.end(), rf.data.begin(), rf.data.end());
+            radius.push_back(r);
+            depth.push_back(d);
+        }
+        vec3 getStart(size_t i) const {
+            return vec3(start[3*i],start[3*i+1],start[3*i+2]);
+        }
+        vec3 getEnd(size_t i) const {
+            return vec3(end[3*i],end[3*i+1],end[3*i+2]);
+        }
+        // as (start,end) pairs
+        std::vector<std::pair<vec3,vec3>> getMoves() const {
+            std::vector<std::pair<vec3,vec3>> moves;
+            moves.reserve(size());
+            for(size_t i = 0; i < size(); ++i)
+                moves.push_back(std::make_pair(getStart(i),getEnd(i)));
+            return moves;
+        }
+    };
+
+    // segment radius until set by '!'
+    const float defaultRadius = 0.1f;
+
     class Turtle {
         // pushdown position and heading, for branching
         struct TurtleState {
@@ -19,14 +66,17 @@ namespace turtle {
             vec3 pos = vec3(0,0,0);
             // heading vec3 = (hx,hy,hz)
             vec3 head = vec3(0,0,1);
+            // segment radius
+            float radius = defaultRadius;
         } state;
         // turtle states
         std::vector<TurtleState> states;
-        // moves
+        // moves, or the segment buffer written instead, if given
         std::vector<std::pair<vec3,vec3>> moves;
+        segments* segs;
     public:
-        Turtle(vec3 pos, vec3 head)
-            : state{pos,head}
+        Turtle(vec3 pos, vec3 head, segments* segs = nullptr)
+            : state{pos,head}, segs(segs)
             {}
         const std::vector<std::pair<vec3,vec3>>& getMoves() const {
             return moves;
@@ -34,7 +84,11 @@ namespace turtle {
         inline void move(float dist) {
             vec3 org = state.pos;
             state.pos += dist*state.head;
-            moves.push_back(std::make_pair(org,state.pos));
+            if(segs) segs->push(org, state.pos, state.radius, states.size());
+            else moves.push_back(std::make_pair(org,state.pos));
+        }
+        inline void width(float r) {
+            state.radius = r;
         }
         inline void rotX(float theta) {
             rotate(state.head, vec3(1,0,0), theta);
@@ -56,43 +110,134 @@ namespace turtle {
 
     const float pi = 4.0f * atanf(1.0f);
 
+    // apply the command for module 'c' with values 'p' to turtle 't'
+    inline void execute(Turtle& t, char c, const double* p) {
+        if(c == 'F') {
+            t.move(p[0]);
+        }
+        else if(c == '[') {
+            t.push();
+        }
+        else if(c == ']') {
+            t.pop();
+        }
+        else if(c == '+') {
+            t.rotX(p[0]);
+        }
+        else if(c == '-') {
+            t.rotX(-p[0]);
+        }
+        else if(c == '&') {
+            t.rotY(p[0]);
+        }
+        else if(c == '^') {
+            t.rotY(-p[0]);
+        }
+        else if(c == '*') {
+            t.rotX(p[0]);
+        }
+        else if(c == '~') {
+            t.rotX(-p[0]);
+        }
+        else if(c == '!') {
+            t.width(p[0]);
+        }
+    }
+
+    // run the turtle over a module source: source(visit) must call
+    // visit(id, vals) for each module of the derived word, in order
+    template<typename Source>
+    void run(Turtle& t, Source source) {
+        // module id -> letter, so the scan only touches the word's arrays
+        std::vector<char> letters;
+        for(const auto& m : grammar::modules)
+            letters.push_back(m->getLetter());
+        source([&](uint16_t id, const double* vals) {
+            execute(t, letters[id], vals);
+        });
+    }
+    // module sources: a packed word, a generator, and a memoized expansion
+    inline auto source(const grammar::packedWord& w) {
+        return [&w](auto visit) {
+            for(size_t i = 0; i < w.size(); ++i)
+                visit(w.ids[i], w.getVals(i));
+        };
+    }
+    inline auto source(grammar::generator& gen) {
+        return [&gen](auto visit) {
+            uint16_t id;
+            const double* vals;
+            size_t count;
+            while(gen.next(id, vals, count))
+                visit(id, vals);
+        };
+    }
+    inline auto source(const grammar::expansion& ex, uint32_t root) {
+        return [&ex, root](auto visit) {
+            ex.walk(root, [&](uint16_t id, const double* vals, size_t) {
+                visit(id, vals);
+            });
+        };
+    }
+
     // perform static interpretation
-    std::vector<std::pair<vec3,vec3>> interpret(grammar::word axiom) 
+    std::vector<std::pair<vec3,vec3>> interpret(const grammar::word& axiom) 
     {
         Turtle t(vec3(0,0,0),vec3(0,0,1));
-        for(grammar::evaluation& e : axiom) {
-            char c = e.getLetter();
-            std::vector<double> p = e.getVals();
-            if(c == 'F') {
-                t.move(p[0]);
-            }
-            else if(c == '[') {
-                t.push();
-            }
-            else if(c == ']') {
-                t.pop();
-            }
-            else if(c == '+') {
-                t.rotX(p[0]);
-            }
-            else if(c == '-') {
-                t.rotX(-p[0]);
-            }
-            else if(c == '&') {
-                t.rotY(p[0]);
-            }
-            else if(c == '^') {
-                t.rotY(-p[0]);
-            }
-            else if(c == '*') {
-                t.rotX(p[0]);
-            }
-            else if(c == '~') {
-                t.rotX(-p[0]);
-            }
+        for(const grammar::evaluation& e : axiom) {
+            execute(t, e.getLetter(), e.getVals().data());
         }
         return t.getMoves();
     }
+    std::vector<std::pair<vec3,vec3>> interpret(const grammar::packedWord& axiom) 
+    {
+        Turtle t(vec3(0,0,0),vec3(0,0,1));
+        run(t, source(axiom));
+        return t.getMoves();
+    }
+    // interpret a derived word as it streams out of a generator
+    std::vector<std::pair<vec3,vec3>> interpret(grammar::generator& gen) 
+    {
+        Turtle t(vec3(0,0,0),vec3(0,0,1));
+        run(t, source(gen));
+        return t.getMoves();
+    }
+    // interpret a memoized derivation, walking its shared fragments
+    std::vector<std::pair<vec3,vec3>> interpret(const grammar::expansion& ex,
+        uint32_t root) 
+    {
+        Turtle t(vec3(0,0,0),vec3(0,0,1));
+        run(t, source(ex, root));
+        return t.getMoves();
+    }
+
+    // interpret into a segment buffer, reserved up front where the number
+    // of moves is known
+    void interpret(const grammar::packedWord& axiom, segments& segs) 
+    {
+        std::vector<char> moves;
+        for(const auto& m : grammar::modules)
+            moves.push_back(m->getLetter() == 'F');
+        size_t count = 0;
+        for(uint16_t id : axiom.ids)
+            count += moves[id];
+        segs.clear();
+        segs.reserve(count);
+        Turtle t(vec3(0,0,0),vec3(0,0,1),&segs);
+        run(t, source(axiom));
+    }
+    void interpret(grammar::generator& gen, segments& segs) 
+    {
+        segs.clear();
+        Turtle t(vec3(0,0,0),vec3(0,0,1),&segs);
+        run(t, source(gen));
+    }
+    void interpret(const grammar::expansion& ex, uint32_t root, segments& segs) 
+    {
+        segs.clear();
+        Turtle t(vec3(0,0,0),vec3(0,0,1),&segs);
+        run(t, source(ex, root));
+    }
 }
 
 #define TURTLE_HPP
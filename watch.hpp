@@ -0,0 +1,74 @@
+// watch.hpp
+// ---------
+// File change notification through inotify. Each file's directory is
+// watched rather than the file, so editors that save by writing a new
+// file and renaming it over the old one are still seen.
+
+#ifndef WATCH_HPP
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <sys/inotify.h>
+#include <unistd.h>
+
+namespace watch {
+    class watcher {
+        int fd;
+        struct file {
+            int wd;
+            std::string name, path;
+        };
+        std::vector<file> files;
+    public:
+        watcher() : fd(inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) {
+            if(fd < 0) std::cout << "(watch) inotify unavailable, not watching files\n";
+        }
+        watcher(const watcher&) = delete;
+        watcher& operator=(const watcher&) = delete;
+        ~watcher() {
+            if(fd >= 0) close(fd);
+        }
+        // watch 'path'; false if its directory can't be watched
+        bool add(const std::string& path) {
+            if(fd < 0) return false;
+            size_t slash = path.find_last_of('/');
+            std::string dir = (slash == std::string::npos) ? "."
+                : (slash == 0) ? "/" : path.substr(0, slash);
+            std::string name = (slash == std::string::npos) ? path : path.substr(slash+1);
+            int wd = inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+            if(wd < 0) {
+                std::cout << "(watch) could not watch " << dir << "\n";
+                return false;
+            }
+            files.push_back(file{wd, name, path});
+            return true;
+        }
+        // the watched files written or replaced since the last call, as
+        // given to add, each listed once; never blocks
+        std::vector<std::string> changed() {
+            std::vector<std::string> paths;
+            if(fd < 0) return paths;
+            alignas(inotify_event) char buffer[4096];
+            ssize_t n;
+            while((n = read(fd, buffer, sizeof(buffer))) > 0) {
+                for(char* p = buffer; p < buffer + n; ) {
+                    const inotify_event* e = reinterpret_cast<const inotify_event*>(p);
+                    p += sizeof(inotify_event) + e->len;
+                    if(e->len == 0) continue;
+                    for(const file& f : files) {
+                        if((f.wd != e->wd) || (f.name != e->name)) continue;
+                        bool seen = false;
+                        for(const auto& q : paths) seen |= (q == f.path);
+                        if(!seen) paths.push_back(f.path);
+                    }
+                }
+            }
+            return paths;
+        }
+    };
+}
+
+#define WATCH_HPP
+#endif